@@ -16,9 +16,14 @@
 #include "read_anno.h"
 #include "dict.h"
 #include <zlib.h>
+#include <pthread.h>
 
 struct read_stat {
 
+    uint64_t reads_input;   // primary records
+    uint64_t reads_pass_qc; // mapped records
+    uint64_t reads_multi;   // mapped records with NH > 1
+
     uint64_t reads_in_region;
     uint64_t reads_in_region_diff_strand;
     
@@ -33,6 +38,22 @@ struct read_stat {
     uint64_t reads_tss;
 };
 
+static void read_stat_add(struct read_stat *s0, struct read_stat const *s1)
+{
+    s0->reads_input += s1->reads_input;
+    s0->reads_pass_qc += s1->reads_pass_qc;
+    s0->reads_multi += s1->reads_multi;
+    s0->reads_in_region += s1->reads_in_region;
+    s0->reads_in_region_diff_strand += s1->reads_in_region_diff_strand;
+    s0->reads_in_intergenic += s1->reads_in_intergenic;
+    s0->reads_in_exon += s1->reads_in_exon;
+    s0->reads_in_intron += s1->reads_in_intron;
+    s0->reads_antisense += s1->reads_antisense;
+    s0->reads_ambiguous += s1->reads_ambiguous;
+    s0->reads_in_exonintron += s1->reads_in_exonintron;
+    s0->reads_tss += s1->reads_tss;
+}
+
 static struct args {
     const char *input_fname;
     const char *output_fname;
@@ -41,6 +62,7 @@ static struct args {
     const char *vtag; // tag name for vcf
     const char *tag; // attribute in BAM
     const char *ctag; // tag name for TSS annotation
+    const char *ftag; // integer feature ID tag, same order as GN
     
     const char *gtf_fname;
     const char *report_fname;
@@ -97,6 +119,7 @@ static struct args {
     .btag            = NULL,
 
     .ctag            = NULL,
+    .ftag            = NULL,
     .tss_mode        = 0,
     .ignore_strand   = 0,
     .splice_consider = 0,
@@ -172,6 +195,35 @@ static char RE_tag[2] = "RE";
 
 extern struct bed_spec *bed_read_vcf(const char *fn);
 
+// Names of integer feature IDs are kept in header, so count can map IDs to features without
+// looking up names. Lines of previous annotation with the same tag are replaced.
+static void hdr_feature_ids(struct dict *names)
+{
+    kstring_t str = {0,0,0};
+    kstring_t prefix = {0,0,0};
+    ksprintf(&prefix, "@CO\t%s:%s:", FEATURE_ID_HDR, args.ftag);
+    
+    const char *p = sam_hdr_str(args.hdr);
+    while (p && *p) {
+        const char *e = strchr(p, '\n');
+        int l = e ? e - p + 1 : strlen(p);
+        if (strncmp(p, prefix.s, prefix.l) != 0) kputsn(p, l, &str);
+        p += l;
+    }
+    if (str.l && str.s[str.l-1] != '\n') kputc('\n', &str);
+    
+    int i;
+    for (i = 0; i < dict_size(names); ++i)
+        ksprintf(&str, "%s%d\t%s\n", prefix.s, i, dict_name(names, i));
+
+    bam_hdr_t *h = sam_hdr_parse(str.l, str.s);
+    CHECK_EMPTY(h, "Failed to update header.");
+    bam_hdr_destroy(args.hdr);
+    args.hdr = h;
+    free(str.s);
+    free(prefix.s);
+}
+
 static int parse_args(int argc, char **argv)
 {
     int i;
@@ -223,6 +275,7 @@ static int parse_args(int argc, char **argv)
         // gtf options
         else if (strcmp(a, "-gtf") == 0) var = &args.gtf_fname;
         else if (strcmp(a, "-tags") == 0) var = &tags;
+        else if (strcmp(a, "-ftag") == 0) var = &args.ftag;
 
         else if (strcmp(a, "-vcf") == 0) var = &args.vcf_fname;
         else if (strcmp(a, "-vtag") == 0) var = &args.vtag;
@@ -255,6 +308,8 @@ static int parse_args(int argc, char **argv)
         error("-bed or -gtf or -chr-species or -vcf must be set.");
 
     if (args.tss_mode == 1 && args.ctag == NULL) error("-ctag must be set if -tss enable.");
+    if (args.ftag && args.gtf_fname == NULL) error("-ftag only works with -gtf.");
+    if (args.ftag && strlen(args.ftag) != 2) error("Bad format of -ftag, %s.", args.ftag);
     
     CHECK_EMPTY(args.output_fname, "-o must be set.");
     CHECK_EMPTY(args.input_fname, "Input bam must be set.");
@@ -308,6 +363,7 @@ static int parse_args(int argc, char **argv)
             free(str.s);
             free(s);
         }
+        if (args.ftag) hdr_feature_ids(args.G->gene_name);
     }
 
     if (args.chr_spec_fname) {
@@ -345,13 +401,112 @@ struct pair {
     int end;
 };
 struct isoform {
-    int n;
+    int n, m;
     struct pair *p;
 };
-struct isoform *bend_sam_isoform(bam1_t *b)
+
+// GX, GN and TX values built for one set of genes and transcripts
+#define TAG_CACHE_SIZE 1024
+
+struct tag_cache {
+    int n_key, m_key;
+    int *key;       // gene id, gene name, transcript ids, -1, for each gene
+    kstring_t str;  // GX, GN and TX values, each one end with '\0'
+    int l_gx, l_gn, l_tx;
+    int n_id;
+    uint32_t *ids;  // gene name index of each gene, for -ftag
+};
+
+// Scratch buffers reused by all reads of one chunk, so annotating a read does not touch the heap
+// once the buffers grow to the largest read seen.
+struct anno_buf {
+    struct isoform S;         // aligned blocks of current read
+    struct gtf_anno_type ann; // gene and transcript hits of current read
+
+    int n_key, m_key;
+    int *key;                 // result set of current read
+    struct tag_cache *cache;  // direct mapped by hash of result set
+
+    // BED names already added to current read, marked with stamp of the read
+    int n_mark;
+    uint32_t *mark;
+    uint32_t stamp;
+    kstring_t str;
+};
+
+struct anno_buf *anno_buf_init()
+{
+    struct anno_buf *buf = malloc(sizeof(*buf));
+    memset(buf, 0, sizeof(*buf));
+    return buf;
+}
+void anno_buf_destroy(struct anno_buf *buf)
+{
+    int i;
+    for (i = 0; i < buf->ann.m; ++i)
+        if (buf->ann.a[i].m) free(buf->ann.a[i].a);
+    if (buf->ann.m) free(buf->ann.a);
+    if (buf->S.m) free(buf->S.p);
+    if (buf->m_key) free(buf->key);
+    if (buf->cache) {
+        for (i = 0; i < TAG_CACHE_SIZE; ++i) {
+            if (buf->cache[i].m_key) free(buf->cache[i].key);
+            if (buf->cache[i].str.m) free(buf->cache[i].str.s);
+            if (buf->cache[i].m_key) free(buf->cache[i].ids);
+        }
+        free(buf->cache);
+    }
+    if (buf->n_mark) free(buf->mark);
+    if (buf->str.m) free(buf->str.s);
+    free(buf);
+}
+
+// Each worker thread keeps its buffers across chunks, so the tag cache stays warm. Buffers are
+// registered and released after all chunks are done.
+static struct {
+    pthread_key_t key;
+    pthread_mutex_t lock;
+    int n, m;
+    struct anno_buf **a;
+} thread_bufs = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static void thread_bufs_init()
+{
+    if (pthread_key_create(&thread_bufs.key, NULL)) error("Failed to create thread key.");
+}
+
+static struct anno_buf *thread_buf()
+{
+    struct anno_buf *buf = pthread_getspecific(thread_bufs.key);
+    if (buf) return buf;
+    buf = anno_buf_init();
+    if (pthread_setspecific(thread_bufs.key, buf)) error("Failed to set thread buffer.");
+    pthread_mutex_lock(&thread_bufs.lock);
+    if (thread_bufs.n == thread_bufs.m) {
+        thread_bufs.m = thread_bufs.m == 0 ? 8 : thread_bufs.m*2;
+        thread_bufs.a = realloc(thread_bufs.a, thread_bufs.m*sizeof(void*));
+    }
+    thread_bufs.a[thread_bufs.n++] = buf;
+    pthread_mutex_unlock(&thread_bufs.lock);
+    return buf;
+}
+
+static void thread_bufs_destroy()
 {
-    struct isoform *S = malloc(sizeof(*S));
-    memset(S, 0, sizeof(*S));
+    int i;
+    for (i = 0; i < thread_bufs.n; ++i) anno_buf_destroy(thread_bufs.a[i]);
+    free(thread_bufs.a);
+    pthread_key_delete(thread_bufs.key);
+}
+
+static void bend_sam_isoform(bam1_t *b, struct isoform *S)
+{
+    // every block ends at a N operator, so n_cigar+1 blocks at most
+    if (S->m < b->core.n_cigar+1) {
+        S->m = b->core.n_cigar+1;
+        S->p = realloc(S->p, S->m*sizeof(struct pair));
+    }
+    S->n = 0;
     int i;
     int start = b->core.pos;
     int l = 0;
@@ -365,7 +520,6 @@ struct isoform *bend_sam_isoform(bam1_t *b)
             l += ncig;
         }
         else if (cig == BAM_CREF_SKIP) {
-            S->p = realloc(S->p, (S->n+1)*sizeof(struct pair));
             S->p[S->n].start = start +1; // 0 based to 1 based
             S->p[S->n].end = start + l;
             // reset block
@@ -374,11 +528,9 @@ struct isoform *bend_sam_isoform(bam1_t *b)
             S->n++;
         }
     } 
-    S->p = realloc(S->p, (S->n+1)*sizeof(struct pair));
     S->p[S->n].start = start +1; // 0 based to 1 based
     S->p[S->n].end = start + l;
     S->n++;
-    return S;    
 }
 
 
@@ -391,14 +543,6 @@ struct ret_dat {
     uint64_t reads_pass_qc;
 };
 
-void gtf_anno_destroy(struct gtf_anno_type *ann)
-{
-    int i;
-    for (i = 0; i < ann->n; ++i)
-        if (ann->a[i].m) free(ann->a[i].a);
-    free(ann->a);
-    free(ann);
-}
 static void gtf_anno_print(struct gtf_anno_type *ann, struct gtf_spec const *G)
 {
     fprintf(stderr, "Type : %s\n", exon_type_names[ann->type]);
@@ -474,49 +618,75 @@ static void gtf_anno_most_likely_type(struct gtf_anno_type *ann)
     }
 }
 
-static enum exon_type query_exon(int start, int end, struct gtf const *G, int *exon)
+// find the first exon whose end is not smaller than start, searched from exon *hint
+static int exon_lower_bound(struct gtf const *G, int start, int hint)
+{
+    int lo = hint, hi, step = 1;
+    if (lo >= G->n_exon || G->exon_maxend[lo] >= start) return lo;
+
+    // galloping from last hit, blocks of a read are sorted
+    for (;;) {
+        hi = lo + step;
+        if (hi >= G->n_exon) {
+            hi = G->n_exon;
+            break;
+        }
+        if (G->exon_maxend[hi] >= start) break;
+        lo = hi;
+        step <<= 1;
+    }
+    
+    // exon_maxend[lo] < start <= exon_maxend[hi]
+    while (hi - lo > 1) {
+        int m = (lo + hi)/2;
+        if (G->exon_maxend[m] >= start) hi = m;
+        else lo = m;
+    }
+    return hi;
+}
+
+static enum exon_type query_exon(int start, int end, struct gtf const *G, int *exon, int *hint)
 {
     assert(G->type == feature_transcript);
-    int j = 0;
     int i;
-    for (i = 0; i < G->n_gtf; ++i) {
-        // from v0.4, transcript and exon in GTF_Spec struct will be sorted by coordinate
-        //struct gtf_lite *g0 = G->strand == 0 ? &G->son[i] : &G->son[G->n_son-i-1];
-        struct gtf *g0 = G->gtf[i];
-        if (g0->type != feature_exon) continue;
-        j++;
-        if (start >= g0->start && end <= g0->end) {
-            *exon = j<<2 | (start==g0->start)<<1 | (end == g0->end);            
+    // from v0.4, transcript and exon in GTF_Spec struct will be sorted by coordinate
+    // exons before i end before start, same as skipped by the linear scan
+    i = exon_lower_bound(G, start, *hint);
+    *hint = i;
+    for (; i < G->n_exon; ++i) {
+        int s0 = G->exon_start[i];
+        int e0 = G->exon_end[i];
+        if (start >= s0 && end <= e0) {
+            *exon = (i+1)<<2 | (start==s0)<<1 | (end == e0);
             return type_exon;
         }
 
-        if (start >= g0->end) continue; // check next exon
+        if (start >= e0) continue; // check next exon
 
-        if (end <= g0->start) return type_intron;
+        if (end <= s0) return type_intron;
 
-        if (start < g0->end && end > g0->end) return type_exon_intron;
+        if (start < e0 && end > e0) return type_exon_intron;
 
-        if (start < g0->start && end > g0->start) return type_exon_intron;
+        if (start < s0 && end > s0) return type_exon_intron;
     }
 
     return type_unknown; // out of range
 }
 
 // for each transcript, return a type of alignment record
-static struct trans_type *gtf_anno_core(struct isoform *S, struct gtf const *g)
+static void gtf_anno_core(struct isoform const *S, struct gtf const *g, struct trans_type *tp)
 {
-    struct trans_type *tp = malloc(sizeof(*tp));
     tp->trans_id = g->transcript_id;
     tp->type = type_unknown;
    
     int exon;
     int last_exon = -1;
+    int hint = 0; // search position, carried across blocks
     int i = 0;
-    // linear search
     for (i = 0; i < S->n; ++i) {
         struct pair *p = &S->p[i];
 
-        enum exon_type t0 = query_exon(p->start, p->end, g, &exon);
+        enum exon_type t0 = query_exon(p->start, p->end, g, &exon, &hint);
 
         if (t0 == type_unknown) {
             if (tp->type != type_unknown)  tp->type = type_ambiguous; // at least some part of read cover this transcript
@@ -565,7 +735,6 @@ static struct trans_type *gtf_anno_core(struct isoform *S, struct gtf const *g)
         }
         
     }
-    return tp;  
 }
 
 // add new trans node to the tree
@@ -574,6 +743,7 @@ void gtf_anno_push(struct trans_type *a, struct gtf_anno_type *ann, int gene_id,
     if (ann->n == ann->m) {
         ann->m += 5;
         ann->a = realloc(ann->a, ann->m*sizeof(struct gene_type));
+        memset(ann->a+ann->n, 0, 5*sizeof(struct gene_type));
     }
     int i;
     for (i = 0; i < ann->n; ++i) {
@@ -590,19 +760,96 @@ void gtf_anno_push(struct trans_type *a, struct gtf_anno_type *ann, int gene_id,
         }
     }
 
+    // slot may be left by last read, keep its transcript array
     struct gene_type *g = &ann->a[ann->n];
     ann->n++;
-    memset(g, 0, sizeof(*g));
     g->gene_id = gene_id;
     g->gene_name = gene_name;
     g->type = type_unknown;
-    g->m = 5;
-    g->a = malloc(sizeof(struct trans_type)*g->m);
+    g->n = 0;
+    if (g->m == 0) {
+        g->m = 5;
+        g->a = malloc(sizeof(struct trans_type)*g->m);
+    }
     g->a[g->n].trans_id = a->trans_id;
     g->a[g->n].type = a->type;
     g->n++;
 }
-void gtf_anno_string(bam1_t *b, struct gtf_anno_type *ann, struct gtf_spec const *G)
+static inline void anno_key_push(struct anno_buf *buf, int k)
+{
+    if (buf->n_key == buf->m_key) {
+        buf->m_key = buf->m_key == 0 ? 16 : buf->m_key*2;
+        buf->key = realloc(buf->key, buf->m_key*sizeof(int));
+    }
+    buf->key[buf->n_key++] = k;
+}
+static inline uint32_t anno_key_hash(const int *key, int n)
+{
+    uint32_t h = 2166136261U;
+    int i;
+    for (i = 0; i < n; ++i) {
+        h ^= (uint32_t)key[i];
+        h *= 16777619U;
+    }
+    return h;
+}
+static void tag_cache_build(struct tag_cache *c, const int *key, int n_key, struct gtf_spec const *G, bam1_t *b)
+{
+    if (c->m_key < n_key) {
+        c->m_key = n_key;
+        c->key = realloc(c->key, c->m_key*sizeof(int));
+        c->ids = realloc(c->ids, c->m_key*sizeof(uint32_t));
+    }
+    memcpy(c->key, key, n_key*sizeof(int));
+    c->n_key = n_key;
+    c->n_id = 0;
+
+    kstring_t gene_name = {0,0,0};
+    kstring_t gene_id   = {0,0,0};
+    kstring_t trans_id  = {0,0,0};
+    int i;
+    for (i = 0; i < n_key; ) {
+        char *gene = NULL;
+        char *id = NULL;
+        if (key[i] != -1) id = dict_name(G->gene_id, key[i]);
+        if (key[i+1] != -1) gene = dict_name(G->gene_name, key[i+1]);
+        c->ids[c->n_id++] = key[i+1];
+        i += 2;
+        
+        if (gene_name.l) {
+            kputc(';', &gene_name);
+            kputc(';', &gene_id);
+            kputc(';', &trans_id);
+        }
+
+        if (gene == NULL && id == NULL) error("No gene name or gene id in gtf? %s", (char*)b->data);
+        if (gene == NULL) id = gene;
+        if (id == NULL) gene = id;
+        kputs(gene, &gene_name);
+        kputs(id, &gene_id);
+        int n_trans = 0;
+        for (; key[i] != -1; ++i) {
+            if (n_trans) kputc(',', &trans_id);
+            kputs(dict_name(G->transcript_id, key[i]), &trans_id);
+            n_trans++;
+        }
+        i++; // skip end of gene
+    }
+
+    c->str.l = 0;
+    c->l_gx = gene_id.l;
+    c->l_gn = gene_name.l;
+    c->l_tx = trans_id.l;
+    if (gene_name.l) {
+        kputsn(gene_id.s, gene_id.l+1, &c->str);
+        kputsn(gene_name.s, gene_name.l+1, &c->str);
+        kputsn(trans_id.l ? trans_id.s : "", trans_id.l+1, &c->str);
+    }
+    if (gene_id.m) free(gene_id.s);
+    if (gene_name.m) free(gene_name.s);
+    if (trans_id.m) free(trans_id.s);
+}
+void gtf_anno_string(bam1_t *b, struct gtf_anno_type *ann, struct gtf_spec const *G, struct anno_buf *buf)
 {
     // 
     if (ann->type == type_unknown) return;
@@ -611,54 +858,43 @@ void gtf_anno_string(bam1_t *b, struct gtf_anno_type *ann, struct gtf_spec const
     else if (ann->type == type_ambiguous) return;
 
     // only exon or splice come here
-    kstring_t gene_name = {0,0,0};
-    kstring_t gene_id   = {0,0,0};
-    kstring_t trans_id  = {0,0,0};
+    // most reads hit a few highly expressed genes, so tag values are built once for each result set
+    buf->n_key = 0;
     int i;
     for (i = 0; i < ann->n; ++i) {
         struct gene_type *g = &ann->a[i];
         if (g->type == ann->type) {
-            char *gene = NULL;
-            char *id = NULL;
-            if (g->gene_name != -1) gene = dict_name(G->gene_name, g->gene_name);
-            if (g->gene_id != -1) id = dict_name(G->gene_id, g->gene_id);
-            
-            if (gene_name.l) {
-                kputc(';', &gene_name);
-                kputc(';', &gene_id);
-                kputc(';', &trans_id);
-            }
-
-            if (gene == NULL && id == NULL) error("No gene name or gene id in gtf? %s", (char*)b->data);
-            if (gene == NULL) id = gene;
-            if (id == NULL) gene = id;
-            kputs(gene, &gene_name);
-            kputs(id, &gene_id);
+            anno_key_push(buf, g->gene_id);
+            anno_key_push(buf, g->gene_name);
             int j;
-            int n_trans = 0;
             for (j = 0; j < g->n; ++j) {
                 struct trans_type *t = &g->a[j];
-                if (t->type == g->type) {                    
-                    if (n_trans) kputc(',', &trans_id);
-                    char *trans = dict_name(G->transcript_id, t->trans_id);
-                    kputs(trans, &trans_id);
-                    n_trans++;
-                }
+                if (t->type == g->type) anno_key_push(buf, t->trans_id);
             }
+            anno_key_push(buf, -1);
         }
     }
+    if (buf->n_key == 0) return;
+
+    if (buf->cache == NULL) buf->cache = calloc(TAG_CACHE_SIZE, sizeof(struct tag_cache));
     
-    if (gene_name.l) {
-        bam_aux_append(b, GX_tag, 'Z', gene_id.l+1, (uint8_t*)gene_id.s);
-        bam_aux_append(b, GN_tag, 'Z', gene_name.l+1, (uint8_t*)gene_name.s);
-        bam_aux_append(b, TX_tag, 'Z', trans_id.l+1, (uint8_t*)trans_id.s);
-        free(gene_id.s);
-        free(gene_name.s);
-        free(trans_id.s);
+    struct tag_cache *c = &buf->cache[anno_key_hash(buf->key, buf->n_key) & (TAG_CACHE_SIZE-1)];
+    if (c->n_key != buf->n_key || memcmp(c->key, buf->key, buf->n_key*sizeof(int)) != 0)
+        tag_cache_build(c, buf->key, buf->n_key, G, b);
+    
+    if (c->l_gn) {
+        char *gx = c->str.s;
+        char *gn = gx + c->l_gx + 1;
+        char *tx = gn + c->l_gn + 1;
+        bam_aux_append(b, GX_tag, 'Z', c->l_gx+1, (uint8_t*)gx);
+        bam_aux_append(b, GN_tag, 'Z', c->l_gn+1, (uint8_t*)gn);
+        bam_aux_append(b, TX_tag, 'Z', c->l_tx+1, (uint8_t*)tx);
+        if (args.ftag) bam_aux_update_array(b, args.ftag, 'I', c->n_id, c->ids);
     }
 }
 
-struct gtf_anno_type *bam_gtf_anno_core(bam1_t *b, struct gtf_spec const *G, bam_hdr_t *h)
+// returned annotation is kept in buf, and only valid until next call
+struct gtf_anno_type *bam_gtf_anno_core(bam1_t *b, struct gtf_spec const *G, bam_hdr_t *h, struct anno_buf *buf)
 {
     //bam_hdr_t *h = args.hdr;
     bam1_core_t *c;
@@ -669,8 +905,8 @@ struct gtf_anno_type *bam_gtf_anno_core(bam1_t *b, struct gtf_spec const *G, bam
 
     if (c->tid <= -1 || c->tid > h->n_targets || (c->flag & BAM_FUNMAP)) return NULL;
     
-    struct gtf_anno_type *ann = malloc(sizeof(*ann));
-    memset(ann, 0, sizeof(*ann));
+    struct gtf_anno_type *ann = &buf->ann;
+    ann->n = 0;
     ann->type = type_unknown;
 
 
@@ -687,7 +923,8 @@ struct gtf_anno_type *bam_gtf_anno_core(bam1_t *b, struct gtf_spec const *G, bam
     // exon == splice > intron > antisense
     // https://github.com/shiquan/PISA/wiki/4.-Annotate-alignment-records-with-GTF-or-BED
 
-    struct isoform *S = bend_sam_isoform(b);
+    struct isoform *S = &buf->S;
+    bend_sam_isoform(b, S);
     
     int antisense = 0;
     int i;
@@ -714,9 +951,9 @@ struct gtf_anno_type *bam_gtf_anno_core(bam1_t *b, struct gtf_spec const *G, bam
         for (j = 0; j < g0->n_gtf; ++j) {
             struct gtf const *g1 = g0->gtf[j];
             if (g1->type != feature_transcript) continue;
-            struct trans_type *a = gtf_anno_core(S, g1);
-            gtf_anno_push(a, ann, g1->gene_id, g1->gene_name);
-            free(a);
+            struct trans_type a;
+            gtf_anno_core(S, g1, &a);
+            gtf_anno_push(&a, ann, g1->gene_id, g1->gene_name);
         }
     }
     
@@ -731,13 +968,11 @@ struct gtf_anno_type *bam_gtf_anno_core(bam1_t *b, struct gtf_spec const *G, bam
         fprintf(stderr, "%s   ", b->data);
         gtf_anno_print(ann, G);
     }
-    free(S->p); free(S);
-
     region_itr_destroy(itr);
 
     return ann;
 }
-int bam_gtf_anno(bam1_t *b, struct gtf_spec const *G, struct read_stat *stat)
+int bam_gtf_anno(bam1_t *b, struct gtf_spec const *G, struct read_stat *stat, struct anno_buf *buf)
 {
     // cleanup all exist tags
     uint8_t *data;
@@ -746,12 +981,13 @@ int bam_gtf_anno(bam1_t *b, struct gtf_spec const *G, struct read_stat *stat)
     if ((data = bam_aux_get(b, GN_tag)) != NULL) bam_aux_del(b, data);
     if ((data = bam_aux_get(b, GX_tag)) != NULL) bam_aux_del(b, data);
     if ((data = bam_aux_get(b, RE_tag)) != NULL) bam_aux_del(b, data);
+    if (args.ftag && (data = bam_aux_get(b, args.ftag)) != NULL) bam_aux_del(b, data);
 
-    struct gtf_anno_type *ann = bam_gtf_anno_core(b, G, args.hdr);
+    struct gtf_anno_type *ann = bam_gtf_anno_core(b, G, args.hdr, buf);
 
     bam_aux_append(b, RE_tag, 'A', 1, (uint8_t*)RE_tags[ann->type]);
 
-    gtf_anno_string(b, ann, G);
+    gtf_anno_string(b, ann, G, buf);
 
     if (ann->type == type_exon) stat->reads_in_exon++;
     else if (ann->type == type_splice) stat->reads_in_exon++; // reads cover two exomes
@@ -804,12 +1040,10 @@ int bam_gtf_anno(bam1_t *b, struct gtf_spec const *G, struct read_stat *stat)
         }
     }
 
-    gtf_anno_destroy(ann);
-    
     return ann->type == type_intergenic ? 0 : 1;
 }
 
-int bam_bed_anno(bam1_t *b, struct bed_spec const *B, struct read_stat *stat)
+int bam_bed_anno(bam1_t *b, struct bed_spec const *B, struct read_stat *stat, struct anno_buf *buf)
 {
     bam_hdr_t *h = args.hdr;
     
@@ -827,19 +1061,26 @@ int bam_bed_anno(bam1_t *b, struct bed_spec const *B, struct read_stat *stat)
     if (itr == NULL) return 0; // query failed
     if (itr->n == 0) return 0; // no hit
 
-    struct dict *val = dict_init();
+    if (buf->n_mark < dict_size(B->name)) {
+        buf->mark = realloc(buf->mark, dict_size(B->name)*sizeof(uint32_t));
+        memset(buf->mark+buf->n_mark, 0, (dict_size(B->name)-buf->n_mark)*sizeof(uint32_t));
+        buf->n_mark = dict_size(B->name);
+    }
+    if (++buf->stamp == 0) { // wrapped, clear all marks
+        memset(buf->mark, 0, buf->n_mark*sizeof(uint32_t));
+        buf->stamp = 1;
+    }
+    
+    kstring_t *str = &buf->str;
+    str->l = 0;
+    // unnamed regions are named by their coordinates, records with same coordinates are adjacent after sorting
+    struct bed *last_unnamed = NULL;
     int i;
-    kstring_t temp = {0,0,0};
     for (i = 0; i < itr->n; ++i) {
         struct bed *bed = (struct bed*)itr->rets[i];
         if (bed->start > endpos || bed->end <= c->pos) continue; // not covered
-        temp.l = 0;
-        
-        if (bed->name == -1) 
-            ksprintf(&temp, "%s:%d-%d", dict_name(B->seqname, bed->seqname), bed->start, bed->end);
-        else
-            kputs(dict_name(B->name, bed->name), &temp);
-        
+
+        int keep = 1;
         if (bed->strand == BED_STRAND_UNK)
             stat->reads_in_region++;
         else {
@@ -848,7 +1089,7 @@ int bam_bed_anno(bam1_t *b, struct bed_spec const *B, struct read_stat *stat)
                     stat->reads_in_region++;               
                 else {
                     stat->reads_in_region_diff_strand++;
-                    temp.l = 0; // reset
+                    keep = 0;
                 }
             }
             else {
@@ -856,33 +1097,35 @@ int bam_bed_anno(bam1_t *b, struct bed_spec const *B, struct read_stat *stat)
                     stat->reads_in_region++;               
                 else {
                     stat->reads_in_region_diff_strand++;
-                    temp.l = 0;
+                    keep = 0;
                 }
             }
         }
         
-        if (temp.l)
-            dict_push(val, temp.s);
-        
+        if (keep == 0) continue;
+
+        if (bed->name == -1) {
+            if (last_unnamed && last_unnamed->seqname == bed->seqname &&
+                last_unnamed->start == bed->start && last_unnamed->end == bed->end) continue;
+            last_unnamed = bed;
+            if (str->l) kputc(';', str);
+            ksprintf(str, "%s:%d-%d", dict_name(B->seqname, bed->seqname), bed->start, bed->end);
+        }
+        else {
+            char *val = dict_name(B->name, bed->name);
+            if (*val == '\0') continue;
+            if (buf->mark[bed->name] == buf->stamp) continue;
+            buf->mark[bed->name] = buf->stamp;
+            if (str->l) kputc(';', str);
+            kputs(val, str);
+        }
     }
     region_itr_destroy(itr);
 
-    if (temp.m) free(temp.s);
-    
-    if (dict_size(val)) {
-        kstring_t str = {0,0,0};
-        int i;
-        for (i = 0; i < dict_size(val); ++i) {
-            if (i) kputc(';', &str);
-            kputs(dict_name(val, i), &str);
-        }
-
-        bam_aux_append(b, args.tag, 'Z', str.l+1, (uint8_t*)str.s);
-        free(str.s);
-        dict_destroy(val);
+    if (str->l) {
+        bam_aux_append(b, args.tag, 'Z', str->l+1, (uint8_t*)str->s);
         return 1;
     }
-    dict_destroy(val);
 
     return 0;
 }
@@ -902,16 +1145,24 @@ void *run_it(void *_d)
 
     dict_set_value(dat->group_stat);
     
-    struct read_stat *stat = malloc(sizeof(*stat));
-    memset(stat, 0, sizeof(*stat));
-    dict_assign_value(dat->group_stat, idx, stat);
+    struct read_stat *all = malloc(sizeof(*all));
+    memset(all, 0, sizeof(*all));
+    dict_assign_value(dat->group_stat, idx, all);
+
+    struct anno_buf *buf = thread_buf();
     
     int i;
     
     for (i = 0; i < dat->p->n; ++i) {
         int ann = 0;
         bam1_t *b = &dat->p->bam[i];
-    
+
+        // stat of this read, added to __ALL__ and its group at the end
+        struct read_stat stat0;
+        struct read_stat *stat = &stat0;
+        memset(stat, 0, sizeof(*stat));
+        struct read_stat *grp = NULL;
+        
         if (args.group_tag) {
             uint8_t *data;
             if ((data = bam_aux_get(b, args.group_tag)) != NULL) {
@@ -923,7 +1174,7 @@ void *run_it(void *_d)
                     memset(s, 0, sizeof(*s));
                     dict_assign_value(dat->group_stat, idx, s);
                 }
-                stat = dict_query_value(dat->group_stat, idx);
+                grp = dict_query_value(dat->group_stat, idx);
             }
         }
 
@@ -939,17 +1190,22 @@ void *run_it(void *_d)
         if (c->flag & BAM_FSECONDARY) goto check_continue;
         
         dat->reads_input++;
+        stat->reads_input++;
         
         // QC
         if (c->tid <= -1 || c->tid > h->n_targets || (c->flag & BAM_FUNMAP)) goto check_continue;
 
         dat->reads_pass_qc++;
+        stat->reads_pass_qc++;
 
+        uint8_t *nh = bam_aux_get(b, "NH");
+        if (nh && bam_aux2i(nh) > 1) stat->reads_multi++;
+        
         if (args.G) 
-            if (bam_gtf_anno(b, args.G, stat)) ann = 1;
+            if (bam_gtf_anno(b, args.G, stat, buf)) ann = 1;
 
         if (args.B)
-            if (bam_bed_anno(b, args.B, stat)) ann = 1;
+            if (bam_bed_anno(b, args.B, stat, buf)) ann = 1;
 
         if (args.V)
             if (bam_vcf_anno(b, args.hdr, args.V, args.vtag)) ann = 1;
@@ -963,6 +1219,9 @@ void *run_it(void *_d)
         }
 
       check_continue:
+        read_stat_add(all, stat);
+        if (grp) read_stat_add(grp, stat);
+        
         if (args.anno_only && ann == 0) {
             b->core.flag |= BAM_FQCFAIL;
         } 
@@ -994,15 +1253,7 @@ static void write_out(void *_d)
 
         struct read_stat *s0 = dict_query_value(args.group_stat, idx);
         struct read_stat *s1 = dict_query_value(dat->group_stat, i);
-        s0->reads_in_region += s1->reads_in_region;
-        s0->reads_in_region_diff_strand += s1->reads_in_region_diff_strand;
-        s0->reads_in_intergenic += s1->reads_in_intergenic;
-        s0->reads_in_exon += s1->reads_in_exon;
-        s0->reads_in_intron += s1->reads_in_intron;
-        s0->reads_antisense += s1->reads_antisense;
-        s0->reads_ambiguous += s1->reads_ambiguous;
-        s0->reads_in_exonintron += s1->reads_in_exonintron;
-        s0->reads_tss += s1->reads_tss;
+        read_stat_add(s0, s1);
     }
     bam_pool_destory(dat->p);
 
@@ -1015,9 +1266,13 @@ static void write_out(void *_d)
     dict_destroy(dat->group_stat);
     free(dat);
 }
+static inline float stat_ratio(uint64_t a, uint64_t b)
+{
+    return b == 0 ? 0 : (float)a/b*100;
+}
 void write_report()
 {
-    if (dict_size(args.group_stat) == 1) {
+    if (args.group_tag == NULL) {
         struct read_stat *s0 = (struct read_stat*)dict_query_value(args.group_stat, 0);
         fprintf(args.fp_report, "Reads Mapped to Genome (Map Quality >= %d),%.1f%%\n", args.map_qual, (float)args.reads_pass_qc/args.reads_input*100);
         
@@ -1039,6 +1294,36 @@ void write_report()
         }
     }
     else {
+        // one row per group, __ALL__ for all reads, ratios are relative to mapped reads of the group
+        fprintf(args.fp_report, "Group,Reads,Mapped to Genome,Multiple Loci");
+        if (args.B) fprintf(args.fp_report, ",BED regions / Peaks,BED regions but on diff strand");
+        if (args.G) {
+            fprintf(args.fp_report, ",Exonic,Intronic,Exonic and Intronic,Antisense,Intergenic,Failed to Interpret Type");
+            if (args.tss_mode) fprintf(args.fp_report, ",Start from TSS");
+        }
+        fputc('\n', args.fp_report);
+        
+        int i;
+        for (i = 0; i < dict_size(args.group_stat); ++i) {
+            struct read_stat *s0 = (struct read_stat*)dict_query_value(args.group_stat, i);
+            fprintf(args.fp_report, "%s,%"PRIu64",%.1f%%,%.1f%%", dict_name(args.group_stat, i), s0->reads_input,
+                    stat_ratio(s0->reads_pass_qc, s0->reads_input), stat_ratio(s0->reads_multi, s0->reads_pass_qc));
+            if (args.B) {
+                fprintf(args.fp_report, ",%.1f%%,%.1f%%", stat_ratio(s0->reads_in_region, s0->reads_pass_qc),
+                        stat_ratio(s0->reads_in_region_diff_strand, s0->reads_pass_qc));
+            }
+            if (args.G) {
+                fprintf(args.fp_report, ",%.1f%%,%.1f%%,%.1f%%,%.1f%%,%.1f%%,%.1f%%",
+                        stat_ratio(s0->reads_in_exon, s0->reads_pass_qc),
+                        stat_ratio(s0->reads_in_intron, s0->reads_pass_qc),
+                        stat_ratio(s0->reads_in_exonintron, s0->reads_pass_qc),
+                        stat_ratio(s0->reads_antisense, s0->reads_pass_qc),
+                        stat_ratio(s0->reads_in_intergenic, s0->reads_pass_qc),
+                        stat_ratio(s0->reads_ambiguous, s0->reads_pass_qc));
+                if (args.tss_mode) fprintf(args.fp_report, ",%.1f%%", stat_ratio(s0->reads_tss, s0->reads_pass_qc));
+            }
+            fputc('\n', args.fp_report);
+        }
     }
 }
 static void memory_release()
@@ -1056,6 +1341,7 @@ static void memory_release()
     if (args.G) gtf_destroy(args.G);
     if (args.V) bed_spec_var_destroy(args.V);
     if (args.fp_report != stderr) fclose(args.fp_report);
+    thread_bufs_destroy();
 }
 
 extern int anno_usage();
@@ -1066,6 +1352,7 @@ int bam_anno_attr(int argc, char *argv[])
     t_real = realtime();
 
     if (parse_args(argc, argv)) return anno_usage();
+    thread_bufs_init();
 
     if (args.n_thread == 1) {
         for (;;) {
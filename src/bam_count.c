@@ -2,12 +2,15 @@
 #include "utils.h"
 #include "number.h"
 #include "dict.h"
-#include "dna_pool.h"
+#include "umi_set.h"
 #include "htslib/khash.h"
 #include "htslib/kstring.h"
 #include "htslib/sam.h"
 #include "htslib/bgzf.h"
+#include "htslib/hts_endian.h"
 #include <sys/stat.h>
+#include <unistd.h>
+#include <pthread.h>
 #include "pisa_version.h" // mex output
 
 // from v0.10, -ttype supported
@@ -17,6 +20,19 @@
 // accept file list
 #include "bam_files.h"
 
+// v0.12, multi-thread count
+void *kt_forpool_init(int n_threads);
+void kt_forpool_destroy(void *_fp);
+void kt_forpool(void *_fp, void (*func)(void*,long,int), void *data, long n);
+void kt_pipeline(int n_threads, void *(*func)(void*, int, void*), void *shared_data, int n_steps);
+
+struct count_table;
+struct count_stream;
+struct packed_list;
+
+// spliced, unspliced and ambiguous matrices in velocity mode
+#define MAX_MATRIX 3
+
 static struct args {
     const char *input_fname;
     const char *whitelist_fname;
@@ -28,16 +44,21 @@ static struct args {
     const char *umi_tag;
 
     const char *prefix;
+    const char *ftag; // integer feature IDs, written by anno -ftag
+    int n_id;
+    char **id_names;  // feature names of IDs, from header
 
     const char *sample_list;
     
     struct dict *features;
     struct dict *barcodes;
+    struct packed_list *packed; // packed whitelist, NULL if barcodes can not be packed
     
     int mapq_thres;
     int use_dup;
     int enable_corr_umi;
     int n_thread;
+    int chunk_size;
     int one_hit;
     
     //htsFile *fp_in;
@@ -53,8 +74,21 @@ static struct args {
     enum exon_type *region_types;
 
     int velocity;
+    int cell_sorted;
+    int binary; // v0.12, binary CSC matrix
     
     struct bam_files *files;
+
+    uint64_t n_read; // records read
+    int read_ret;
+    struct file_readers *readers; // read input files in parallel
+    int rec_bits; // bits of record index in one file, records are indexed by file and index in parallel mode
+    void *pool;
+    int n_shard;
+    struct count_table *tables; // one table per shard
+    struct count_stream *stream; // -cell-sorted
+    
+    uint64_t n_entry[MAX_MATRIX]; // non-zero entries in each matrix
 } args = {
     .input_fname     = NULL,
     .whitelist_fname = NULL,
@@ -65,14 +99,19 @@ static struct args {
     .umi_tag         = NULL,
 
     .prefix          = NULL,
+    .ftag            = NULL,
+    .n_id            = 0,
+    .id_names        = NULL,
     .barcodes        = NULL,
     .features        = NULL,
+    .packed          = NULL,
 
     .mapq_thres      = 20,
     .use_dup         = 0,
     .enable_corr_umi = 0,
     .one_hit         = 0,
     .n_thread        = 5,
+    .chunk_size      = 100000,
     //.fp_in           = NULL,
     //.hdr             = NULL,
     .n_record        = 0,
@@ -84,55 +123,365 @@ static struct args {
     .n_type          = 0,
     .region_types    = NULL,
     .velocity        = 0,
+    .cell_sorted     = 0,
+    .binary          = 0,
     .files           = NULL,
+    .n_read          = 0,
+    .read_ret        = 0,
+    .readers         = NULL,
+    .rec_bits        = 0,
+    .pool            = NULL,
+    .n_shard         = 1,
+    .tables          = NULL,
+    .stream          = NULL,
+    .n_entry         = {0},
 };
 
 struct counts {
     uint32_t count;
-    struct PISA_dna_pool *p;
-
     uint32_t unspliced;
-    struct PISA_dna_pool *up;
+    uint32_t ambiguous; // UMIs found in both spliced and unspliced reads, also in unspliced
+    struct umi_set p;   // UMIs of this feature, spliced and unspliced reads are marked by state
+};
+
+// cell id to counts, one hash for each feature
+KHASH_MAP_INIT_INT(cell, struct counts)
+
+struct cell_count {
+    int idx;
+    struct counts *c;
+};
+
+static int cmpfunc(const void *_a, const void *_b)
+{
+    const struct cell_count *a = _a;
+    const struct cell_count *b = _b;
+    return a->idx - b->idx;
+}
+
+// matrices to write, spliced, unspliced and ambiguous for -velo, ambiguous needs UMIs
+static int n_matrix()
+{
+    if (args.velocity == 0) return 1;
+    return args.umi_tag ? 3 : 2;
+}
+
+static const char *matrix_name(int i)
+{
+    static const char *names[] = { "spliced", "unspliced", "ambiguous" };
+    return args.velocity ? names[i] : "matrix";
+}
+
+static inline uint32_t count_value(struct counts const *c, int i)
+{
+    if (args.velocity == 0) return c->count;
+    if (i == 0) return c->count - c->unspliced;
+    return i == 1 ? c->unspliced : c->ambiguous;
+}
+
+// UMIs to counts
+static void count_finish(struct counts *c)
+{
+    if (args.umi_tag == NULL) return;
+    if (args.velocity) {
+        uint32_t n[4];
+        umi_set_count_state(&c->p, n);
+        c->unspliced = n[UMI_UNSPLICED] + n[UMI_SPLICED|UMI_UNSPLICED];
+        c->ambiguous = n[UMI_SPLICED|UMI_UNSPLICED];
+    }
+    c->count = umi_set_size(&c->p);
+    umi_set_clear(&c->p);
+}
+
+// Counts are partitioned into shards by cell barcode. Each shard is only updated by one thread
+// at a time, so no lock is needed. Barcodes and features are indexed in each shard, the record
+// first seen is kept to build global indexes in the same order as counting in one thread.
+struct count_table {
+    struct dict *barcodes; // not used if -list set, cell ids from whitelist instead
+    struct dict *features; // value is kh_cell_t, keyed by cell id of this table
+    int m_bc, m_ft;
+    uint64_t *bc_first;
+    uint64_t *ft_first;
+    
+    int *bc_map; // local cell id to global cell id
+    int *ft_idx; // global feature id to local feature id, -1 if not in this shard
+    int *id_map; // -ftag ID to local feature id, -1 if not seen yet
+
+    uint64_t n_record;
+    uint64_t n_record2;
+    uint64_t n_entry[MAX_MATRIX];
+    
+    kstring_t str[MAX_MATRIX]; // formatted MEX records
+    struct cell_count *cells;
+    int m_cell;
+
+    // counts of features in the write window, cells of each feature sorted
+    struct cell_count *wcells;
+    int n_wcell, m_wcell;
+    int *woff;
+};
+
+// records read in one chunk, records failed in flag or map quality check are skipped
+struct count_chunk {
+    int n, m;
+    bam1_t *bam;
+    char **alias;
+    uint64_t offset; // index of first record in this chunk
+
+    // records are routed to shards by blocks, no lock needed
+    char **cell;  // cell barcode
+    int *cell_id; // cell id in whitelist
+    int *order;   // record index of each block, grouped by shard
+    int *off;     // start of each shard in order, n_shard+1 for each block
+};
+
+// For input grouped by cell barcode, counts of current cell are kept only. Records of the
+// cell are written to temp matrix files once cell changes, and headers are added at the end.
+struct count_stream {
+    kstring_t cell;  // current cell barcode
+    int cell_id;     // -1 if no record of current cell counted yet
+    int m;
+    struct counts *counts; // counts of current cell, indexed by feature id
+    uint8_t *used;
+    int n_touch, m_touch;
+    int *touch;      // features of current cell
+    uint8_t *done;   // cells in whitelist have been written
+    kstring_t fname[MAX_MATRIX];
+    BGZF *fp[MAX_MATRIX]; // temp matrix files
+    kstring_t str[MAX_MATRIX];
+};
+
+#define COUNT_BLOCK 1024
+
+static void count_table_init(struct count_table *t)
+{
+    memset(t, 0, sizeof(*t));
+    t->barcodes = dict_init();
+    t->features = dict_init();
+    dict_set_value(t->features);
+    if (args.n_id) {
+        t->id_map = malloc(args.n_id*sizeof(int));
+        int i;
+        for (i = 0; i < args.n_id; ++i) t->id_map[i] = -1;
+    }
+}
+
+static void count_table_destroy(struct count_table *t)
+{
+    int i;
+    for (i = 0; i < dict_size(t->features); ++i) {
+        kh_cell_t *v = dict_query_value(t->features, i);
+        if (v) kh_destroy(cell, v);
+    }
+    dict_destroy(t->barcodes);
+    dict_destroy(t->features);
+    free(t->bc_first);
+    free(t->ft_first);
+    free(t->bc_map);
+    free(t->ft_idx);
+    free(t->id_map);
+    int j;
+    for (j = 0; j < MAX_MATRIX; ++j) free(t->str[j].s);
+    free(t->cells);
+    free(t->wcells);
+    free(t->woff);
+}
+
+static void first_seen(uint64_t **a, int *m, int idx, uint64_t rec)
+{
+    if (idx >= *m) {
+        int m0 = *m;
+        *m = idx < 1024 ? 1024 : idx*2;
+        *a = realloc(*a, *m*sizeof(uint64_t));
+        int i;
+        for (i = m0; i < *m; ++i) (*a)[i] = UINT64_MAX;
+    }
+    if (rec < (*a)[idx]) (*a)[idx] = rec;
+}
+
+// export counts of one feature in global cell order, return number of cells
+static int feature_counts(struct count_table *t, kh_cell_t *v)
+{
+    int n = 0;
+    khint_t k;
+    if (v == NULL) return 0;
+    if (kh_size(v) > t->m_cell) {
+        t->m_cell = kh_size(v);
+        t->cells = realloc(t->cells, t->m_cell*sizeof(struct cell_count));
+    }
+    for (k = kh_begin(v); k != kh_end(v); ++k) {
+        if (!kh_exist(v, k)) continue;
+        t->cells[n].idx = args.whitelist_fname ? kh_key(v, k) : t->bc_map[kh_key(v, k)];
+        t->cells[n].c = &kh_val(v, k);
+        n++;
+    }
+    qsort(t->cells, n, sizeof(struct cell_count), cmpfunc);
+    return n;
+}
+
+// Barcodes in whitelist are 2-bit packed and kept in an open-addressing table, so reads from
+// cells not in the list are rejected without hashing strings. Only used if all barcodes are
+// equal length, no longer than 32 bp and only contain A, C, G or T.
+struct packed_list {
+    int len;
+    uint32_t m;
+    uint64_t *key;
+    int *id; // cell id, -1 for empty slot
 };
 
+static int packed_barcode(const char *s, int len, uint64_t *key)
+{
+    uint64_t x = 0;
+    int i;
+    for (i = 0; i < len; ++i) {
+        switch (s[i]) {
+            case 'A': x = x<<2; break;
+            case 'C': x = x<<2 | 1; break;
+            case 'G': x = x<<2 | 2; break;
+            case 'T': x = x<<2 | 3; break;
+            default: return -1; // also end of string
+        }
+    }
+    if (s[len] != '\0') return -1;
+    *key = x;
+    return 0;
+}
+
+static inline uint32_t packed_hash(uint64_t key, uint32_t m)
+{
+    return (uint32_t)((key * 0x9E3779B97F4A7C15ULL) >> 32) & (m - 1);
+}
+
+static void packed_list_destroy(struct packed_list *p)
+{
+    free(p->key);
+    free(p->id);
+    free(p);
+}
+
+static struct packed_list *packed_list_build(struct dict *D)
+{
+    int n = dict_size(D);
+    int len = strlen(dict_name(D, 0));
+    if (len == 0 || len > 32) return NULL;
+    
+    struct packed_list *p = malloc(sizeof(*p));
+    p->len = len;
+    p->m = 16;
+    while (p->m < (uint32_t)n*2) p->m <<= 1;
+    p->key = malloc(p->m*sizeof(uint64_t));
+    p->id = malloc(p->m*sizeof(int));
+    uint32_t j;
+    for (j = 0; j < p->m; ++j) p->id[j] = -1;
+    
+    int i;
+    for (i = 0; i < n; ++i) {
+        uint64_t key;
+        if (packed_barcode(dict_name(D, i), len, &key)) {
+            packed_list_destroy(p);
+            return NULL;
+        }
+        for (j = packed_hash(key, p->m); p->id[j] != -1; j = (j + 1) & (p->m - 1));
+        p->key[j] = key;
+        p->id[j] = i;
+    }
+    return p;
+}
+
+// return cell id, or -1 if not in list
+static inline int packed_list_query(struct packed_list const *p, const char *s)
+{
+    uint64_t key;
+    if (packed_barcode(s, p->len, &key)) return -1;
+    uint32_t j;
+    for (j = packed_hash(key, p->m); p->id[j] != -1; j = (j + 1) & (p->m - 1))
+        if (p->key[j] == key) return p->id[j];
+    return -1;
+}
+
 static void memory_release()
 {
     //bam_hdr_destroy(args.hdr);
     //sam_close(args.fp_in);
 
     close_bam_files(args.files);
+    free(args.region_types);
     
     int i;
-    int n_feature;
-    n_feature = dict_size(args.features);
-    for (i = 0; i < n_feature; ++i) {
-        struct PISA_dna_pool *v = dict_query_value(args.features, i);
-        PISA_idx_destroy(v);
-    }
+    for (i = 0; i < args.n_id; ++i) free(args.id_names[i]);
+    free(args.id_names);
+    for (i = 0; i < args.n_shard; ++i) count_table_destroy(&args.tables[i]);
+    free(args.tables);
     dict_destroy(args.features);
     dict_destroy(args.barcodes);
+    if (args.packed) packed_list_destroy(args.packed);
 }
 
 extern int bam_count_usage();
 
+// names of -ftag IDs from header, all bams should be annotated by the same GTF
+static void load_feature_ids(const char *fname)
+{
+    htsFile *fp = hts_open(fname, "r");
+    CHECK_EMPTY(fp, "%s : %s.", fname, strerror(errno));
+    bam_hdr_t *hdr = sam_hdr_read(fp);
+    CHECK_EMPTY(hdr, "Failed to open header of %s.", fname);
+
+    kstring_t prefix = {0,0,0};
+    ksprintf(&prefix, "@CO\t%s:%s:", FEATURE_ID_HDR, args.ftag);
+    int m = 0;
+    const char *p = sam_hdr_str(hdr);
+    while (p && *p) {
+        const char *e = strchr(p, '\n');
+        int l = e ? e - p : strlen(p);
+        if (strncmp(p, prefix.s, prefix.l) == 0) {
+            char *name;
+            long id = strtol(p + prefix.l, &name, 10);
+            if (*name != '\t' || id < 0) error("Bad format of header line, %.*s", l, p);
+            name++;
+            if (id >= m) {
+                int m0 = m;
+                m = id < 1024 ? 1024 : id*2;
+                args.id_names = realloc(args.id_names, m*sizeof(char*));
+                memset(args.id_names + m0, 0, (m - m0)*sizeof(char*));
+            }
+            if (args.id_names[id]) error("Duplicated feature ID in header, %ld.", id);
+            args.id_names[id] = strndup(name, p + l - name);
+            if (id >= args.n_id) args.n_id = id + 1;
+        }
+        p += e ? l + 1 : l;
+    }
+    if (args.n_id == 0) error("No feature ID of %s found in header of %s, annotate with `PISA anno -ftag` first.", args.ftag, fname);
+    int i;
+    for (i = 0; i < args.n_id; ++i)
+        if (args.id_names[i] == NULL) error("Feature ID %d is not found in header.", i);
+    
+    free(prefix.s);
+    bam_hdr_destroy(hdr);
+    hts_close(fp);
+}
+
 static int parse_args(int argc, char **argv)
 {
     int i;
     const char *mapq = NULL;
     const char *n_thread = NULL;
     const char *region_types = NULL;
+    const char *chunk = NULL;
     for (i = 1; i < argc;) {
         const char *a = argv[i++];
         const char **var = 0;
         if (strcmp(a, "-h") == 0 || strcmp(a, "--help") == 0) return 1;
         if (strcmp(a, "-tag") == 0 || strcmp(a, "-cb") == 0) var = &args.tag;
         else if (strcmp(a, "-anno-tag") == 0) var = &args.anno_tag;
+        else if (strcmp(a, "-ftag") == 0) var = &args.ftag;
         else if (strcmp(a, "-list") == 0) var = &args.whitelist_fname;
         else if (strcmp(a, "-umi") == 0) var = &args.umi_tag;
         else if (strcmp(a, "-o") == 0) var = &args.output_fname;
         else if (strcmp(a, "-outdir") == 0) var = &args.outdir;
         else if (strcmp(a, "-q") == 0) var = &mapq;
         else if (strcmp(a, "-@") == 0) var = &n_thread;
+        else if (strcmp(a, "-chunk") == 0) var = &chunk;
         else if (strcmp(a, "-ttag") == 0) var = &args.region_type_tag;
         else if (strcmp(a, "-ttype") == 0) var = &region_types;
         else if (strcmp(a, "-prefix") == 0) var = &args.prefix;
@@ -149,6 +498,14 @@ static int parse_args(int argc, char **argv)
             args.one_hit = 1;
             continue;
         }
+        else if (strcmp(a, "-cell-sorted") == 0) {
+            args.cell_sorted = 1;
+            continue;
+        }
+        else if (strcmp(a, "-bin") == 0) {
+            args.binary = 1;
+            continue;
+        }
         
         else if (strcmp(a, "-corr") == 0) {
             //args.enable_corr_umi = 1;
@@ -178,15 +535,18 @@ static int parse_args(int argc, char **argv)
     if (args.input_fname && args.sample_list) error("Input bam conflict with -sample-list.");
     
     if (args.output_fname) {
-        warnings("PISA now support MEX format. Old cell X gene expression format is very poor performance. Try -outdir instead of -o.");
+        warnings("PISA now support MEX format. Dense cell X gene matrix is large for single cell data. Try -outdir instead of -o.");
     }
     
     if (args.tag == 0 && args.alias_file_cb == 0)
         error("No cell barcode specified and -file-barcode disabled.");
 
-    if (args.anno_tag == 0) error("No anno tag specified.");
+    if (args.anno_tag == 0 && args.ftag == 0) error("No anno tag specified.");
 
     if (n_thread) args.n_thread = str2int((char*)n_thread);
+    if (chunk) args.chunk_size = str2int((char*)chunk);
+    if (args.n_thread < 1) args.n_thread = 1;
+    if (args.chunk_size < 1) error("Chunk size should be a positive number.");
 
     if (args.outdir) {
          struct stat sb;
@@ -205,14 +565,28 @@ static int parse_args(int argc, char **argv)
     if (mapq) {
         args.mapq_thres = str2int(mapq);        
     }
+    if (args.ftag) load_feature_ids(args.files->files[0].fname);
+    
     args.features = dict_init();
-    dict_set_value(args.features);
+    args.n_shard = args.n_thread;
+
+    if (args.binary) {
+        if (args.outdir == NULL && args.output_fname == NULL) error("-bin only works with -outdir or -o.");
+        if (args.cell_sorted) error("-bin is not supported with -cell-sorted.");
+    }
+    
+    if (args.cell_sorted) {
+        if (args.outdir == NULL) error("-cell-sorted only works with -outdir.");
+        if (args.output_fname) error("-o is not supported with -cell-sorted.");
+        args.n_shard = 1;
+    }
     
     args.barcodes = dict_init();
 
     if (args.whitelist_fname) {
         dict_read(args.barcodes, args.whitelist_fname);
         if (dict_size(args.barcodes) == 0) error("Barcode list is empty?");
+        args.packed = packed_list_build(args.barcodes);
     }
 
     if (region_types) {
@@ -237,20 +611,172 @@ static int parse_args(int argc, char **argv)
     return 0;
 }
 
-int count_matrix_core(bam1_t *b, char *tag)
+static void out_path(kstring_t *str, const char *name)
 {
-    if (args.tag) {
-        uint8_t *tag0 = bam_aux_get(b, args.tag);
-        if (!tag0) return 1;
+    str->l = 0;
+    kputs(args.outdir, str);
+    if (args.outdir[strlen(args.outdir)-1] != '/') kputc('/', str);
+    if (args.prefix) kputs(args.prefix, str);
+    kputs(name, str);
+}
+
+static struct count_stream *count_stream_init()
+{
+    struct count_stream *st = malloc(sizeof(*st));
+    memset(st, 0, sizeof(*st));
+    st->cell_id = -1;
+    if (args.whitelist_fname) st->done = calloc(dict_size(args.barcodes), 1);
+
+    kstring_t name = {0,0,0};
+    int i;
+    for (i = 0; i < n_matrix(); ++i) {
+        name.l = 0;
+        ksprintf(&name, "%s.mtx.gz.tmp", matrix_name(i));
+        out_path(&st->fname[i], name.s);
+        st->fp[i] = bgzf_open(st->fname[i].s, "w");
+        CHECK_EMPTY(st->fp[i], "%s : %s.", st->fname[i].s, strerror(errno));
+        bgzf_mt(st->fp[i], args.n_thread, 256);
+    }
+    free(name.s);
+    return st;
+}
+
+static void count_stream_destroy(struct count_stream *st)
+{
+    int i;
+    for (i = 0; i < MAX_MATRIX; ++i) {
+        // not written, nothing counted
+        if (st->fp[i]) {
+            bgzf_close(st->fp[i]);
+            unlink(st->fname[i].s);
+        }
+        free(st->fname[i].s);
+        free(st->str[i].s);
+    }
+    free(st->cell.s);
+    free(st->counts);
+    free(st->used);
+    free(st->touch);
+    free(st->done);
+    free(st);
+}
+
+static int cmpint(const void *a, const void *b)
+{
+    return *(const int*)a - *(const int*)b;
+}
 
-        tag = (char*)(tag0+1);
+// write counts of current cell and reset
+static void stream_flush()
+{
+    struct count_stream *st = args.stream;
+    if (st->cell_id == -1) return;
+
+    qsort(st->touch, st->n_touch, sizeof(int), cmpint);
+    int i, j;
+    for (j = 0; j < n_matrix(); ++j) st->str[j].l = 0;
+    for (i = 0; i < st->n_touch; ++i) {
+        int f = st->touch[i];
+        struct counts *count = &st->counts[f];
+        count_finish(count);
+        args.n_record += count->count;
+        args.n_record2 += count->unspliced;
+        
+        for (j = 0; j < n_matrix(); ++j) {
+            uint32_t n = count_value(count, j);
+            if (n == 0) continue;
+            ksprintf(&st->str[j], "%d\t%d\t%u\n", f+1, st->cell_id+1, n);
+            args.n_entry[j]++;
+        }
+        st->used[f] = 0;
     }
-    else if (args.alias_file_cb) {
-        assert(tag);
+    
+    for (j = 0; j < n_matrix(); ++j) {
+        kstring_t *str = &st->str[j];
+        if (str->l && bgzf_write(st->fp[j], str->s, str->l) != str->l) error("Failed to write file.");
     }
+
+    if (st->done) st->done[st->cell_id] = 1;
+    st->cell_id = -1;
+    st->n_touch = 0;
+}
+
+// input is not grouped by cell, remove temp matrices before exit
+static void stream_regroup_error(const char *tag)
+{
+    struct count_stream *st = args.stream;
+    int i;
+    for (i = 0; i < MAX_MATRIX; ++i) {
+        if (st->fp[i] == NULL) continue;
+        bgzf_close(st->fp[i]);
+        st->fp[i] = NULL;
+        unlink(st->fname[i].s);
+    }
+    error("Records are not grouped by cell barcode, %s appears again.", tag);
+}
+
+// first counted record of a cell, make sure this cell not seen before
+static int stream_cell(const char *tag, int cell_id)
+{
+    struct count_stream *st = args.stream;
+    if (st->cell_id != -1) return st->cell_id;
     
-    uint8_t *anno_tag = bam_aux_get(b, args.anno_tag);
+    if (args.whitelist_fname) {
+        if (st->done[cell_id]) stream_regroup_error(tag);
+    }
+    else {
+        if (dict_query(args.barcodes, tag) != -1) stream_regroup_error(tag);
+        cell_id = dict_push(args.barcodes, tag);
+    }
+    st->cell_id = cell_id;
+    return cell_id;
+}
+
+static struct counts *stream_counts(int idx)
+{
+    struct count_stream *st = args.stream;
+    if (idx >= st->m) {
+        int m0 = st->m;
+        st->m = idx < 1024 ? 1024 : idx*2;
+        st->counts = realloc(st->counts, st->m*sizeof(struct counts));
+        st->used = realloc(st->used, st->m);
+        memset(st->used + m0, 0, st->m - m0);
+    }
+    if (st->used[idx] == 0) {
+        st->used[idx] = 1;
+        memset(&st->counts[idx], 0, sizeof(struct counts));
+        if (st->n_touch == st->m_touch) {
+            st->m_touch = st->m_touch == 0 ? 1024 : st->m_touch*2;
+            st->touch = realloc(st->touch, st->m_touch*sizeof(int));
+        }
+        st->touch[st->n_touch++] = idx;
+    }
+    return &st->counts[idx];
+}
+
+// feature index in table, or in global features for -cell-sorted
+static int feature_index(struct count_table *t, const char *name)
+{
+    struct dict *d = args.cell_sorted ? args.features : t->features;
+    int idx = dict_query(d, name);
+    if (idx == -1) idx = dict_push(d, name);
+    return idx;
+}
+
+// name of an ID is only looked up once for each table
+static int feature_index_id(struct count_table *t, int64_t id)
+{
+    if (id < 0 || id >= args.n_id) error("Feature ID %"PRId64" is not found in header.", id);
+    if (t->id_map[id] == -1) t->id_map[id] = feature_index(t, args.id_names[id]);
+    return t->id_map[id];
+}
+
+// cell barcode and cell id (if whitelist set) have been checked while routing
+static int count_matrix_core(bam1_t *b, char *tag, int cell_id, uint64_t rec, struct count_table *t)
+{
+    uint8_t *anno_tag = bam_aux_get(b, args.ftag ? args.ftag : args.anno_tag);
     if (!anno_tag) return 1;
+    if (args.ftag && *anno_tag != 'B') return 1;
 
     if (args.umi_tag) {
         uint8_t *umi_tag = bam_aux_get(b, args.umi_tag);
@@ -269,20 +795,23 @@ int count_matrix_core(bam1_t *b, char *tag)
             unspliced = 1;
     }
     
-    int cell_id;
-    if (args.whitelist_fname) {
-        cell_id = dict_query(args.barcodes, tag);
-        if (cell_id == -1) return 1;
+    if (args.cell_sorted) {
+        cell_id = stream_cell(tag, cell_id);
     }
-    else {
-        cell_id = dict_push(args.barcodes, tag);
+    else if (args.whitelist_fname == NULL) {
+        cell_id = dict_push(t->barcodes, tag);
+        first_seen(&t->bc_first, &t->m_bc, cell_id, rec);
     }
 
     // for each feature
     kstring_t str = {0,0,0};
-    kputs((char*)(anno_tag+1), &str);
     int n_gene;
-    int *s = str_split(&str, &n_gene); // seperator ; or ,
+    int *s = NULL;
+    if (args.ftag) n_gene = bam_auxB_len(anno_tag);
+    else {
+        kputs((char*)(anno_tag+1), &str);
+        s = str_split(&str, &n_gene); // seperator ; or ,
+    }
 
     // Sometime two or more genes or functional regions can overlapped with each other, if default PISA counts the reads for both of these regions.
     // But if -one-hit set, these reads will be filtered.
@@ -295,47 +824,42 @@ int count_matrix_core(bam1_t *b, char *tag)
     int i;
     for (i = 0; i < n_gene; ++i) {
         // Features (Gene or Region)
-        char *val = str.s + s[i];
+        int idx;
+        if (args.ftag) idx = feature_index_id(t, bam_auxB2i(anno_tag, i));
+        else idx = feature_index(t, str.s + s[i]);
+
+        struct counts *count;
+        if (args.cell_sorted) {
+            count = stream_counts(idx);
+            goto update_count;
+        }
         
-        int idx = dict_query(args.features, val);
-        if (idx == -1) idx = dict_push(args.features, val);
-
-        struct PISA_dna_pool *v = dict_query_value(args.features, idx);
+        first_seen(&t->ft_first, &t->m_ft, idx, rec<<16 | (i < 0xffff ? i : 0xffff));
+        
+        kh_cell_t *v = dict_query_value(t->features, idx);
 
         if (v == NULL) {
-            v = PISA_dna_pool_init();
-            dict_assign_value(args.features, idx, v);
+            v = kh_init(cell);
+            dict_assign_value(t->features, idx, v);
         } 
         // not store cell barcode for each hash, use id number instead to reduce memory
-        struct PISA_dna *c= PISA_idx_query(v, cell_id);
-        if (c == NULL) {
-            c = PISA_idx_push(v, cell_id);
-        //if (c->data == NULL) {
-            struct counts *counts = malloc(sizeof(struct counts));
-            if (args.umi_tag)  {
-                counts->p = PISA_dna_pool_init();
-                counts->up = args.velocity == 1 ? PISA_dna_pool_init() : NULL;
-            }
-            else {
-                counts->count = 0;
-                counts->unspliced = 0;
-            }
-            c->data = counts;
-        }
+        int ret;
+        khint_t k = kh_put(cell, v, cell_id, &ret);
+        count = &kh_val(v, k);
+        if (ret) memset(count, 0, sizeof(*count));
+
+      update_count:
 
         if (args.umi_tag) {
             uint8_t *umi_tag = bam_aux_get(b, args.umi_tag);
             assert(umi_tag);
             char *val = (char*)(umi_tag+1);
-            assert(c->data);
-            struct counts *count = c->data;
-            PISA_dna_push(count->p, val);
-
-            if (args.velocity && unspliced)
-                PISA_dna_push(count->up, val);
+            if (args.velocity)
+                umi_set_push_state(&count->p, val, unspliced ? UMI_UNSPLICED : UMI_SPLICED);
+            else
+                umi_set_push(&count->p, val);
         }
         else {
-            struct counts *count = c->data;
             count->count++;
 
             if (args.velocity && unspliced)
@@ -347,277 +871,961 @@ int count_matrix_core(bam1_t *b, char *tag)
     return 0;
 }
 
-static void update_counts()
+static void count_record(bam1_t *b, char *cell, int cell_id, uint64_t rec, struct count_table *t)
+{
+    if (args.n_type > 0) {
+        uint8_t *data = bam_aux_get(b, args.region_type_tag);
+        if (!data) return;
+
+        int k;
+        for (k = 0; k < args.n_type; ++k) 
+            if (args.region_types[k] == RE_type_map(data[1])) break;
+
+        if (k == args.n_type) return;
+    }
+        
+    count_matrix_core(b, cell, cell_id, rec, t);
+}
+
+static void count_chunk_destroy(struct count_chunk *c)
 {
-    int n_feature = dict_size(args.features);
     int i;
-    for (i = 0; i < n_feature; ++i) {
-        struct PISA_dna_pool *v = dict_query_value(args.features, i);
-        int j;
-        int n_cell = v->l;
-        for (j = 0; j < n_cell; ++j) {
-            struct counts *count = v->data[j].data;
-            assert(count);
-            if (args.umi_tag) {
-                int size = count->p->l;
-                PISA_dna_destroy(count->p);
-                count->count = size;
-            }
+    // the record after last one may be read but skipped
+    for (i = 0; i < c->m; ++i) 
+        if (c->bam[i].data) free(c->bam[i].data);
+    free(c->bam);
+    free(c->alias);
+    free(c->cell);
+    free(c->cell_id);
+    free(c->order);
+    free(c->off);
+    free(c);
+}
 
-            if (args.velocity) {
-                if (args.umi_tag) {
-                    int size = count->up->l;
-                    PISA_dna_destroy(count->up);
-                    count->unspliced = size;
-                }
-            }
-            args.n_record += count->count;
-            args.n_record2 += count->unspliced;
+static struct count_chunk *count_chunk_init(uint64_t offset)
+{
+    struct count_chunk *c = malloc(sizeof(*c));
+    c->n = 0;
+    c->m = args.chunk_size;
+    c->bam = calloc(c->m, sizeof(bam1_t));
+    c->alias = malloc(c->m*sizeof(char*));
+    c->offset = offset;
+    c->cell = malloc(c->m*sizeof(char*));
+    c->cell_id = malloc(c->m*sizeof(int));
+    c->order = malloc(c->m*sizeof(int));
+    c->off = malloc(((c->m + COUNT_BLOCK - 1)/COUNT_BLOCK)*(args.n_shard+1)*sizeof(int));
+    return c;
+}
+
+static int count_chunk_keep(bam1_t *b, bam_hdr_t *hdr)
+{
+    bam1_core_t *core;
+    core = &b->core;
+
+    if (core->tid <= -1 || core->tid > hdr->n_targets || (core->flag & BAM_FUNMAP)) return 0;
+    if (core->qual < args.mapq_thres) return 0;
+    if (args.use_dup == 0 && core->flag & BAM_FDUP) return 0;
+    return 1;
+}
+
+static struct count_chunk *count_chunk_read()
+{
+    if (args.read_ret < 0) return NULL;
+    
+    struct count_chunk *c = count_chunk_init(args.n_read);
+    
+    while (c->n < c->m) {
+        bam1_t *b = &c->bam[c->n];
+        args.read_ret = read_bam_files(args.files, b);
+        if (args.read_ret < 0) break;
+        args.n_read++;
+        
+        bam_hdr_t *hdr = get_hdr(args.files);
+
+        char *alias = get_alias(args.files);
+        if (args.alias_file_cb == 1 && !alias)
+            error("No alias found for %s", get_fname(args.files));
+        
+        if (count_chunk_keep(b, hdr) == 0) continue;
+
+        c->alias[c->n++] = alias;
+    }
+    
+    if (c->n == 0 && args.read_ret < 0) {
+        count_chunk_destroy(c);
+        return NULL;
+    }
+    return c;
+}
+
+// For more than one input file, files are read by reader threads at the same time, and chunks are
+// counted in any order. Records are indexed by file and index in the file, so names are still
+// ordered as reading files one by one.
+struct file_readers {
+    pthread_mutex_t lock;
+    pthread_cond_t pushed; // a chunk is pushed or a reader exits
+    pthread_cond_t popped;
+    int n, m;              // chunks in queue, queue is limited to m chunks
+    struct count_chunk **a;
+    int next_file;
+    int n_running;
+    int n_thread;
+    pthread_t *tid;
+};
+
+static void readers_push(struct file_readers *r, struct count_chunk *c)
+{
+    pthread_mutex_lock(&r->lock);
+    while (r->n == r->m) pthread_cond_wait(&r->popped, &r->lock);
+    r->a[r->n++] = c;
+    pthread_cond_signal(&r->pushed);
+    pthread_mutex_unlock(&r->lock);
+}
+
+static void read_one_file(struct file_readers *r, int i)
+{
+    struct bam_file *file = &args.files->files[i];
+    if (args.alias_file_cb == 1 && !file->alias)
+        error("No alias found for %s", file->fname);
+
+    htsFile *fp = hts_open(file->fname, "r");
+    if (fp == NULL) error("%s : %s.", file->fname, strerror(errno));
+    htsFormat type = *hts_get_format(fp);
+    if (type.format != bam && type.format != sam)
+        error("Unsupported input format, only support BAM/SAM/CRAM format.");
+    bam_hdr_t *hdr = sam_hdr_read(fp);
+    if (hdr == NULL) error("Failed to open bam header of %s", file->fname);
+
+    uint64_t n_read = 0;
+    int ret = 0;
+    while (ret >= 0) {
+        struct count_chunk *c = count_chunk_init(((uint64_t)i<<args.rec_bits) + n_read);
+        while (c->n < c->m) {
+            bam1_t *b = &c->bam[c->n];
+            ret = sam_read1(fp, hdr, b);
+            if (ret < 0) break;
+            if (++n_read >> args.rec_bits) error("Too many records in %s.", file->fname);
+            if (count_chunk_keep(b, hdr) == 0) continue;
+            c->alias[c->n++] = file->alias;
         }
+        if (c->n == 0) count_chunk_destroy(c);
+        else readers_push(r, c);
     }
+    if (ret != -1) warnings("Truncated file? %s", file->fname);
+    
+    bam_hdr_destroy(hdr);
+    sam_close(fp);
 }
-static void write_outs()
+
+static void *file_reader(void *_r)
 {
-    int n_barcode = dict_size(args.barcodes);
-    int n_feature = dict_size(args.features);
+    struct file_readers *r = (struct file_readers*)_r;
+    for (;;) {
+        pthread_mutex_lock(&r->lock);
+        int i = r->next_file++;
+        pthread_mutex_unlock(&r->lock);
+        if (i >= args.files->n) break;
+        if (args.files->files[i].state == file_closed) continue; // skipped line in list
+        read_one_file(r, i);
+    }
+    pthread_mutex_lock(&r->lock);
+    r->n_running--;
+    pthread_cond_signal(&r->pushed);
+    pthread_mutex_unlock(&r->lock);
+    return NULL;
+}
 
-    if (n_barcode == 0) error("No barcode found.");
-    if (n_feature == 0) error("No feature found.");
-    if (args.n_record == 0) {
-        warnings("No anntated record found.");
-        return;
+static struct file_readers *file_readers_start(int n_thread)
+{
+    struct file_readers *r = malloc(sizeof(*r));
+    memset(r, 0, sizeof(*r));
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->pushed, NULL);
+    pthread_cond_init(&r->popped, NULL);
+    r->m = n_thread;
+    r->a = malloc(r->m*sizeof(void*));
+    r->n_thread = n_thread;
+    r->n_running = n_thread;
+    r->tid = malloc(n_thread*sizeof(pthread_t));
+    int i;
+    for (i = 0; i < n_thread; ++i) pthread_create(&r->tid[i], NULL, file_reader, r);
+    return r;
+}
+
+// return NULL if all files are read
+static struct count_chunk *file_readers_pop(struct file_readers *r)
+{
+    pthread_mutex_lock(&r->lock);
+    while (r->n == 0 && r->n_running > 0) pthread_cond_wait(&r->pushed, &r->lock);
+    struct count_chunk *c = NULL;
+    if (r->n > 0) {
+        c = r->a[0];
+        memmove(r->a, r->a+1, (r->n-1)*sizeof(void*));
+        r->n--;
+        pthread_cond_signal(&r->popped);
     }
-    args.n_record1 = args.n_record;
+    pthread_mutex_unlock(&r->lock);
+    return c;
+}
 
-    if (args.velocity) args.n_record1 = args.n_record - args.n_record2;
+static void file_readers_destroy(struct file_readers *r)
+{
+    int i;
+    for (i = 0; i < r->n_thread; ++i) pthread_join(r->tid[i], NULL);
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->pushed);
+    pthread_cond_destroy(&r->popped);
+    free(r->a);
+    free(r->tid);
+    free(r);
+}
+
+// route records of one block to shards by cell barcode
+static void route_worker(void *_d, long i, int tid)
+{
+    struct count_chunk *c = (struct count_chunk*)_d;
+    int n = args.n_shard;
+    int b0 = i*COUNT_BLOCK;
+    int e = b0 + COUNT_BLOCK < c->n ? b0 + COUNT_BLOCK : c->n;
+    int *off = c->off + i*(n+1);
+    int shard[COUNT_BLOCK];
+    int j;
     
-    if (args.outdir) {
-        kstring_t barcode_str = {0,0,0};
-        kstring_t feature_str = {0,0,0};
-        kstring_t mex_str = {0,0,0};
-        kstring_t unspliced_str = {0,0,0};
-        
-        kputs(args.outdir, &barcode_str);
-        kputs(args.outdir, &feature_str);
-        kputs(args.outdir, &mex_str);
-        kputs(args.outdir, &unspliced_str);
+    memset(off, 0, (n+1)*sizeof(int));
+    for (j = b0; j < e; ++j) {
+        shard[j-b0] = -1;
+        char *cell = c->alias[j];
+        if (args.tag) {
+            uint8_t *data = bam_aux_get(&c->bam[j], args.tag);
+            if (!data) continue;
+            cell = (char*)(data+1);
+        }
+        assert(cell);
+        c->cell[j] = cell;
+        c->cell_id[j] = -1;
+        if (args.whitelist_fname) {
+            c->cell_id[j] = args.packed ? packed_list_query(args.packed, cell) : dict_query(args.barcodes, cell);
+            if (c->cell_id[j] == -1) continue;
+            shard[j-b0] = c->cell_id[j] % n;
+        }
+        else {
+            shard[j-b0] = kh_str_hash_func(cell) % n;
+        }
+        off[shard[j-b0]+1]++;
+    }
+    for (j = 0; j < n; ++j) off[j+1] += off[j];
 
-        if (args.outdir[strlen(args.outdir)-1] != '/') {
-            kputc('/', &barcode_str);
-            kputc('/', &feature_str);
-            kputc('/', &mex_str);
-            kputc('/', &unspliced_str);
+    int cur[n];
+    memcpy(cur, off, n*sizeof(int));
+    for (j = b0; j < e; ++j)
+        if (shard[j-b0] != -1) c->order[b0 + cur[shard[j-b0]]++] = j;
+}
+
+// count all records of one shard, blocks in order
+static void shard_worker(void *_d, long i, int tid)
+{
+    struct count_chunk *c = (struct count_chunk*)_d;
+    struct count_table *t = &args.tables[i];
+    int n = args.n_shard;
+    int n_block = (c->n + COUNT_BLOCK - 1)/COUNT_BLOCK;
+    int k, j;
+    for (k = 0; k < n_block; ++k) {
+        int *off = c->off + k*(n+1);
+        int *order = c->order + k*COUNT_BLOCK;
+        for (j = off[i]; j < off[i+1]; ++j) {
+            int r = order[j];
+            count_record(&c->bam[r], c->cell[r], c->cell_id[r], c->offset + r, t);
         }
+    }
+}
 
-        if (args.prefix) {
-            kputs(args.prefix, &barcode_str);
-            kputs(args.prefix, &feature_str);
-            kputs(args.prefix, &mex_str);
-            kputs(args.prefix, &unspliced_str);
+// records are routed to one shard, count them in order
+static void stream_chunk(struct count_chunk *c)
+{
+    struct count_stream *st = args.stream;
+    int n_block = (c->n + COUNT_BLOCK - 1)/COUNT_BLOCK;
+    int k, j;
+    for (k = 0; k < n_block; ++k) {
+        int *off = c->off + k*2;
+        int *order = c->order + k*COUNT_BLOCK;
+        for (j = off[0]; j < off[1]; ++j) {
+            int r = order[j];
+            if (st->cell.l == 0 || strcmp(st->cell.s, c->cell[r]) != 0) {
+                stream_flush();
+                st->cell.l = 0;
+                kputs(c->cell[r], &st->cell);
+            }
+            count_record(&c->bam[r], c->cell[r], c->cell_id[r], c->offset + r, &args.tables[0]);
         }
-        
-        kputs("barcodes.tsv.gz", &barcode_str);
-        kputs("features.tsv.gz", &feature_str);
-        if (args.velocity)
-            kputs("spliced.mtx.gz", &mex_str);
-        else
-            kputs("matrix.mtx.gz", &mex_str);
-
-        kputs("unspliced.mtx.gz", &unspliced_str);
-        
-        BGZF *barcode_fp = bgzf_open(barcode_str.s, "w");
-        bgzf_mt(barcode_fp, args.n_thread, 256);
-        CHECK_EMPTY(barcode_fp, "%s : %s.", barcode_str.s, strerror(errno));
-        
-        int i;
+    }
+}
 
-        kstring_t str = {0,0,0};
-        kstring_t str2 = {0,0,0};
-        
-        for (i = 0; i < n_barcode; ++i) {
-            kputs(dict_name(args.barcodes, i), &str);
-            kputc('\n', &str);
-        }
-        int l = bgzf_write(barcode_fp, str.s, str.l);
-        if (l != str.l) error("Failed to write.");
-        bgzf_close(barcode_fp);
-
-        str.l = 0;
-        BGZF *feature_fp = bgzf_open(feature_str.s, "w");
-        bgzf_mt(feature_fp, args.n_thread, 256);
-        CHECK_EMPTY(feature_fp, "%s : %s.", feature_str.s, strerror(errno));
-        for (i = 0; i < n_feature; ++i) {
-            kputs(dict_name(args.features,i), &str);
-            kputc('\n', &str);
-        }
-        l = bgzf_write(feature_fp, str.s, str.l);
-        if (l != str.l) error("Failed to write.");
-        
-        bgzf_close(feature_fp);
+// run func for each item, in the thread pool if there is one
+static void for_each(void (*func)(void*,long,int), void *data, long n)
+{
+    if (args.pool) kt_forpool(args.pool, func, data, n);
+    else {
+        long i;
+        for (i = 0; i < n; ++i) func(data, i, 0);
+    }
+}
 
-        str.l = 0;
+static void *count_pipeline(void *shared, int step, void *_d)
+{
+    if (step == 0) return args.readers ? file_readers_pop(args.readers) : count_chunk_read();
+
+    struct count_chunk *c = (struct count_chunk*)_d;
+    int n_block = (c->n + COUNT_BLOCK - 1)/COUNT_BLOCK;
+    for_each(route_worker, c, n_block);
+    if (args.cell_sorted) stream_chunk(c);
+    else for_each(shard_worker, c, args.n_shard);
+    count_chunk_destroy(c);
+    return 0;
+}
 
-        BGZF *mex_fp = bgzf_open(mex_str.s, "w");
-        CHECK_EMPTY(mex_fp, "%s : %s.", mex_str.s, strerror(errno));
-        
-        bgzf_mt(mex_fp, args.n_thread, 256);
-        kputs("%%MatrixMarket matrix coordinate integer general\n", &str);
-        kputs("% Generated by PISA ", &str);
-        kputs(PISA_VERSION, &str);
-        kputc('\n', &str);
-        ksprintf(&str, "%d\t%d\t%llu\n", n_feature, n_barcode, args.n_record1);
+struct first_name {
+    char *name;
+    uint64_t first;
+};
 
-        BGZF *unspliced_fp = NULL;
-        if (args.velocity) {
-            unspliced_fp = bgzf_open(unspliced_str.s, "w");
-            if (unspliced_fp == NULL) error("%s : %s.", unspliced_str.s, strerror(errno));
-        
-            bgzf_mt(unspliced_fp, args.n_thread, 256);
-            kputs("%%MatrixMarket matrix coordinate integer general\n", &str2);
-            kputs("% Generated by PISA ", &str2);
-            kputs(PISA_VERSION, &str2);
-            kputc('\n', &str2);
-            ksprintf(&str2, "%d\t%d\t%llu\n", n_feature, n_barcode, args.n_record2);
+static int cmpfunc1(const void *_a, const void *_b)
+{
+    const struct first_name *a = _a;
+    const struct first_name *b = _b;
+    return a->first < b->first ? -1 : a->first > b->first;
+}
+
+// push names from all tables into global dict, in the order of first seen
+static void merge_names(struct dict *D, int n, struct dict **local, uint64_t **first)
+{
+    int i, j, k = 0, l = 0;
+    for (i = 0; i < n; ++i) l += dict_size(local[i]);
+    struct first_name *a = malloc(l*sizeof(struct first_name));
+    for (i = 0; i < n; ++i) {
+        for (j = 0; j < dict_size(local[i]); ++j) {
+            a[k].name = dict_name(local[i], j);
+            a[k].first = first[i][j];
+            k++;
         }
-        
-        for (i = 0; i < n_feature; ++i) {
-            struct PISA_dna_pool *v = dict_query_value(args.features, i);
-            int j;
-            int n_cell = v->l;
-            for (j = 0; j < n_cell; ++j) {
-                struct counts *count = v->data[j].data;
-                if (args.velocity) {
-                    int spliced = count->count - count->unspliced;
-                    if (spliced > 0) ksprintf(&str, "%d\t%d\t%u\n", i+1, v->data[j].idx+1, spliced);
-                    if (count->unspliced > 0) ksprintf(&str2, "%d\t%d\t%u\n", i+1, v->data[j].idx+1, count->unspliced);
-                }
-                else
-                    ksprintf(&str, "%d\t%d\t%u\n", i+1, v->data[j].idx+1, count->count);
-                
-                free(count);
-            }
+    }
+    qsort(a, l, sizeof(struct first_name), cmpfunc1);
+    for (i = 0; i < l; ++i) dict_push(D, a[i].name);
+    free(a);
+}
+
+// global barcode and feature indexes, counts are kept in shards
+static void build_index()
+{
+    int n = args.n_shard;
+    int i, j;
+    struct dict **local = malloc(n*sizeof(struct dict*));
+    uint64_t **first = malloc(n*sizeof(uint64_t*));
+    
+    if (args.whitelist_fname == NULL) {
+        for (i = 0; i < n; ++i) {
+            local[i] = args.tables[i].barcodes;
+            first[i] = args.tables[i].bc_first;
+        }
+        merge_names(args.barcodes, n, local, first);
+    }
+    
+    for (i = 0; i < n; ++i) {
+        local[i] = args.tables[i].features;
+        first[i] = args.tables[i].ft_first;
+    }
+    merge_names(args.features, n, local, first);
+    
+    free(local);
+    free(first);
 
-            if (str.l > 100000000) {
-                int l = bgzf_write(mex_fp, str.s, str.l);
-                if (l != str.l) error("Failed to write file.");
-                str.l = 0;
+    int n_feature = dict_size(args.features);
+    for (i = 0; i < n; ++i) {
+        struct count_table *t = &args.tables[i];
+        int n_bc = dict_size(t->barcodes);
+        t->bc_map = malloc((n_bc+1)*sizeof(int));
+        for (j = 0; j < n_bc; ++j) t->bc_map[j] = dict_query(args.barcodes, dict_name(t->barcodes, j));
+        t->ft_idx = malloc(n_feature*sizeof(int));
+        for (j = 0; j < n_feature; ++j) t->ft_idx[j] = -1;
+        for (j = 0; j < dict_size(t->features); ++j)
+            t->ft_idx[dict_query(args.features, dict_name(t->features, j))] = j;
+    }
+}
 
-                if (args.velocity) {
-                    l = bgzf_write(unspliced_fp, str2.s, str2.l);
-                    if (l != str2.l) error("Failed to write file.");
-                    str2.l = 0;                
-                }
-            }
+static void update_shard(void *_d, long i, int tid)
+{
+    struct count_table *t = &args.tables[i];
+    int n_feature = dict_size(t->features);
+    int j;
+    for (j = 0; j < n_feature; ++j) {
+        kh_cell_t *v = dict_query_value(t->features, j);
+        khint_t k;
+        for (k = kh_begin(v); k != kh_end(v); ++k) {
+            if (!kh_exist(v, k)) continue;
+            struct counts *count = &kh_val(v, k);
+            count_finish(count);
+            t->n_record += count->count;
+            t->n_record2 += count->unspliced;
+            int m;
+            for (m = 0; m < n_matrix(); ++m)
+                if (count_value(count, m) > 0) t->n_entry[m]++;
         }
+    }
+}
+
+static void update_counts()
+{
+    for_each(update_shard, NULL, args.n_shard);
+    int i, j;
+    for (i = 0; i < args.n_shard; ++i) {
+        args.n_record += args.tables[i].n_record;
+        args.n_record2 += args.tables[i].n_record2;
+        for (j = 0; j < MAX_MATRIX; ++j) args.n_entry[j] += args.tables[i].n_entry[j];
+    }
+}
 
-        if (str.l) {
-            l = bgzf_write(mex_fp, str.s, str.l);
-            if (l != str.l) error("Failed to wirte.");
+#define WRITE_WINDOW 1024
+
+static inline int window_end(int start)
+{
+    return start + WRITE_WINDOW < dict_size(args.features) ? start + WRITE_WINDOW : dict_size(args.features);
+}
+
+// collect counts of features in window [start, start+WRITE_WINDOW) of one shard
+static void collect_shard(void *_d, long i, int tid)
+{
+    struct count_table *t = &args.tables[i];
+    int start = *(int*)_d;
+    int end = window_end(start);
+    int f;
+    if (t->woff == NULL) t->woff = malloc((WRITE_WINDOW+1)*sizeof(int));
+    t->n_wcell = 0;
+    for (f = start; f < end; ++f) {
+        t->woff[f-start] = t->n_wcell;
+        if (t->ft_idx[f] == -1) continue;
+        kh_cell_t *v = dict_query_value(t->features, t->ft_idx[f]);
+        int n_cell = feature_counts(t, v);
+        if (t->n_wcell + n_cell > t->m_wcell) {
+            t->m_wcell = t->n_wcell + n_cell;
+            kroundup32(t->m_wcell);
+            t->wcells = realloc(t->wcells, t->m_wcell*sizeof(struct cell_count));
         }
+        memcpy(t->wcells + t->n_wcell, t->cells, n_cell*sizeof(struct cell_count));
+        t->n_wcell += n_cell;
+    }
+    t->woff[end-start] = t->n_wcell;
+}
 
-        if (str2.l) {
-            l = bgzf_write(unspliced_fp, str2.s, str2.l);
-            if (l != str2.l) error("Failed to wirte.");
-        
+// format MEX records of the i-th part of window, cells of one feature from all shards are merged,
+// so records are in the same order for any number of shards
+static void format_part(void *_d, long i, int tid)
+{
+    struct count_table *t = &args.tables[i];
+    int start = *(int*)_d;
+    int end = window_end(start);
+    int size = (end - start + args.n_shard - 1)/args.n_shard;
+    int f0 = start + i*size;
+    int f1 = f0 + size < end ? f0 + size : end;
+    int f, j, k, m;
+    for (m = 0; m < n_matrix(); ++m) t->str[m].l = 0;
+    for (f = f0; f < f1; ++f) {
+        int n_cell = 0;
+        for (k = 0; k < args.n_shard; ++k) {
+            struct count_table *t0 = &args.tables[k];
+            int n = t0->woff[f-start+1] - t0->woff[f-start];
+            if (n == 0) continue;
+            if (n_cell + n > t->m_cell) {
+                t->m_cell = n_cell + n;
+                t->cells = realloc(t->cells, t->m_cell*sizeof(struct cell_count));
+            }
+            memcpy(t->cells + n_cell, t0->wcells + t0->woff[f-start], n*sizeof(struct cell_count));
+            n_cell += n;
+        }
+        if (args.n_shard > 1) qsort(t->cells, n_cell, sizeof(struct cell_count), cmpfunc);
+        for (j = 0; j < n_cell; ++j) {
+            struct counts *count = t->cells[j].c;
+            for (m = 0; m < n_matrix(); ++m) {
+                uint32_t n = count_value(count, m);
+                if (n > 0) ksprintf(&t->str[m], "%d\t%d\t%u\n", f+1, t->cells[j].idx+1, n);
+            }
         }
+    }
+}
 
-        free(str.s);
-        if (str2.m) free(str2.s);
-        free(mex_str.s);
-        free(barcode_str.s);
-        free(feature_str.s);
-        if (unspliced_str.m) free(unspliced_str.s);
-        bgzf_close(mex_fp);
+static void write_names(const char *fname, struct dict *D)
+{
+    BGZF *fp = bgzf_open(fname, "w");
+    CHECK_EMPTY(fp, "%s : %s.", fname, strerror(errno));
+    bgzf_mt(fp, args.n_thread, 256);
+
+    kstring_t str = {0,0,0};
+    int i;
+    for (i = 0; i < dict_size(D); ++i) {
+        kputs(dict_name(D, i), &str);
+        kputc('\n', &str);
     }
+    int l = bgzf_write(fp, str.s, str.l);
+    if (l != str.l) error("Failed to write.");
+    bgzf_close(fp);
+    free(str.s);
+}
+
+static void mex_header(kstring_t *str, uint64_t n_entry)
+{
+    kputs("%%MatrixMarket matrix coordinate integer general\n", str);
+    kputs("% Generated by PISA ", str);
+    kputs(PISA_VERSION, str);
+    kputc('\n', str);
+    ksprintf(str, "%d\t%d\t%"PRIu64"\n", dict_size(args.features), dict_size(args.barcodes), n_entry);
+}
+
+// write header into a new block, then copy compressed records from temp file, without its EOF block
+static void mex_patch_header(const char *fname, const char *tmp_fname, uint64_t n_entry)
+{
+    kstring_t str = {0,0,0};
+    mex_header(&str, n_entry);
     
-    // header
-    if (args.output_fname) {
-        int i;
-        FILE *out = fopen(args.output_fname, "w");
-        CHECK_EMPTY(out, "%s : %s.", args.output_fname, strerror(errno));
-        fputs("ID", out);
-        
-        for (i = 0; i < n_barcode; ++i)
-            fprintf(out, "\t%s", dict_name(args.barcodes, i));
-        fprintf(out, "\n");
-        uint32_t *temp = malloc(n_barcode*sizeof(int));        
-        for (i = 0; i < n_feature; ++i) {
-            struct PISA_dna_pool *v = dict_query_value(args.features, i);
-            int j;
-            int n_cell = v->l;
-            memset(temp, 0, sizeof(int)*n_barcode);
-            fputs(dict_name(args.features, i), out);
-            for (j = 0; j < n_cell; ++j) {
-                int idx = v->data[j].idx;
-                temp[idx] = v->data[j].count;
+    BGZF *fp = bgzf_open(fname, "w");
+    CHECK_EMPTY(fp, "%s : %s.", fname, strerror(errno));
+    if (bgzf_write(fp, str.s, str.l) != str.l) error("Failed to write.");
+    if (bgzf_flush(fp) != 0) error("Failed to write.");
+
+    struct stat sb;
+    if (stat(tmp_fname, &sb) != 0) error("%s : %s.", tmp_fname, strerror(errno));
+    FILE *in = fopen(tmp_fname, "rb");
+    CHECK_EMPTY(in, "%s : %s.", tmp_fname, strerror(errno));
+
+    int64_t left = sb.st_size - 28; // BGZF EOF block
+    char *buf = malloc(1<<20);
+    while (left > 0) {
+        size_t l = fread(buf, 1, left < (1<<20) ? left : (1<<20), in);
+        if (l == 0) error("Failed to read %s.", tmp_fname);
+        if (bgzf_raw_write(fp, buf, l) != l) error("Failed to write.");
+        left -= l;
+    }
+    free(buf);
+    fclose(in);
+    bgzf_close(fp);
+    unlink(tmp_fname);
+    free(str.s);
+}
+
+// Binary matrix in CSC layout, one column per cell, all integers are little-endian.
+//   magic "PISAMTX\1", uint32 version, uint32 layout (0 for CSC)
+//   uint64 n_feature, n_barcode, nnz
+//   uint64 indptr[n_barcode+1], uint32 feature[nnz] (0-based), uint32 count[nnz]
+// Features of each cell are sorted.
+struct csc_matrix {
+    uint64_t *ptr;
+    uint64_t *cur;
+    uint32_t *idx;
+    uint32_t *val;
+};
+
+static struct csc_matrix csc[MAX_MATRIX];
+
+// swap integers to little-endian in place, nothing to do on little-endian hosts
+static void le_u32(uint32_t *a, uint64_t n)
+{
+#ifndef HTS_LITTLE_ENDIAN
+    uint64_t i;
+    for (i = 0; i < n; ++i) u32_to_le(a[i], (uint8_t*)&a[i]);
+#endif
+}
+static void le_u64(uint64_t *a, uint64_t n)
+{
+#ifndef HTS_LITTLE_ENDIAN
+    uint64_t i;
+    for (i = 0; i < n; ++i) u64_to_le(a[i], (uint8_t*)&a[i]);
+#endif
+}
+
+static void csc_count_shard(void *_d, long i, int tid)
+{
+    struct count_table *t = &args.tables[i];
+    int j;
+    for (j = 0; j < dict_size(t->features); ++j) {
+        kh_cell_t *v = dict_query_value(t->features, j);
+        khint_t k;
+        for (k = kh_begin(v); k != kh_end(v); ++k) {
+            if (!kh_exist(v, k)) continue;
+            int c = args.whitelist_fname ? kh_key(v, k) : t->bc_map[kh_key(v, k)];
+            struct counts *count = &kh_val(v, k);
+            int m;
+            for (m = 0; m < n_matrix(); ++m)
+                if (count_value(count, m) > 0) csc[m].ptr[c+1]++;
+        }
+    }
+}
+
+// cells are not shared by shards, so each shard fills its own columns
+static void csc_fill_shard(void *_d, long i, int tid)
+{
+    struct count_table *t = &args.tables[i];
+    int f;
+    for (f = 0; f < dict_size(args.features); ++f) {
+        if (t->ft_idx[f] == -1) continue;
+        kh_cell_t *v = dict_query_value(t->features, t->ft_idx[f]);
+        khint_t k;
+        for (k = kh_begin(v); k != kh_end(v); ++k) {
+            if (!kh_exist(v, k)) continue;
+            int c = args.whitelist_fname ? kh_key(v, k) : t->bc_map[kh_key(v, k)];
+            struct counts *count = &kh_val(v, k);
+            int m;
+            for (m = 0; m < n_matrix(); ++m) {
+                uint32_t n = count_value(count, m);
+                if (n == 0) continue;
+                uint64_t p = csc[m].cur[c]++;
+                csc[m].idx[p] = f;
+                csc[m].val[p] = n;
             }
+        }
+    }
+}
+
+static void csc_write(const char *fname, struct csc_matrix *m)
+{
+    uint64_t n_barcode = dict_size(args.barcodes);
+    uint64_t n_feature = dict_size(args.features);
+    uint64_t nnz = m->ptr[n_barcode];
+    uint8_t hdr[40];
+    memcpy(hdr, "PISAMTX\1", 8);
+    u32_to_le(1, hdr+8);  // version
+    u32_to_le(0, hdr+12); // layout
+    u64_to_le(n_feature, hdr+16);
+    u64_to_le(n_barcode, hdr+24);
+    u64_to_le(nnz, hdr+32);
+    // arrays are freed after written
+    le_u64(m->ptr, n_barcode+1);
+    le_u32(m->idx, nnz);
+    le_u32(m->val, nnz);
+    
+    FILE *fp = fopen(fname, "wb");
+    CHECK_EMPTY(fp, "%s : %s.", fname, strerror(errno));
+    if (fwrite(hdr, 1, 40, fp) != 40 ||
+        fwrite(m->ptr, sizeof(uint64_t), n_barcode+1, fp) != n_barcode+1 ||
+        fwrite(m->idx, sizeof(uint32_t), nnz, fp) != nnz ||
+        fwrite(m->val, sizeof(uint32_t), nnz, fp) != nnz)
+        error("Failed to write %s.", fname);
+    fclose(fp);
+}
+
+static void write_bin()
+{
+    int n_barcode = dict_size(args.barcodes);
+    int n = n_matrix();
+    int i, j;
+    for (i = 0; i < n; ++i) csc[i].ptr = calloc(n_barcode+1, sizeof(uint64_t));
+    
+    for_each(csc_count_shard, NULL, args.n_shard);
+
+    for (i = 0; i < n; ++i) {
+        struct csc_matrix *m = &csc[i];
+        for (j = 0; j < n_barcode; ++j) m->ptr[j+1] += m->ptr[j];
+        m->cur = malloc(n_barcode*sizeof(uint64_t));
+        memcpy(m->cur, m->ptr, n_barcode*sizeof(uint64_t));
+        m->idx = malloc((m->ptr[n_barcode]+1)*sizeof(uint32_t));
+        m->val = malloc((m->ptr[n_barcode]+1)*sizeof(uint32_t));
+    }
+    
+    for_each(csc_fill_shard, NULL, args.n_shard);
+
+    kstring_t fname = {0,0,0};
+    kstring_t name = {0,0,0};
+    for (i = 0; i < n; ++i) {
+        name.l = 0;
+        ksprintf(&name, "%s.bin", matrix_name(i));
+        out_path(&fname, name.s);
+        csc_write(fname.s, &csc[i]);
+        free(csc[i].ptr);
+        free(csc[i].cur);
+        free(csc[i].idx);
+        free(csc[i].val);
+    }
+    free(fname.s);
+    free(name.s);
+}
+
+// Dense matrix, one row per feature. Rows of a window are filled into a block by shards in
+// parallel, then written as text or as binary (-bin). Binary dense matrix is BGZF compressed,
+//   magic "PISADNS\1", uint32 version, uint32 layout (0 for one row per feature)
+//   uint64 n_feature, n_barcode, barcodes and features end with '\0'
+//   uint32 count[n_feature][n_barcode]
+struct dense_block {
+    int start, end; // features in this block
+    uint32_t *val;  // (end-start) x n_barcode
+    kstring_t *str; // formatted text rows
+};
 
-            for (j = 0; j < n_barcode; ++j)
-                fprintf(out, "\t%u", temp[j]);
-            fputc('\n', out);
+static void dense_fill_shard(void *_d, long i, int tid)
+{
+    struct dense_block *d = (struct dense_block*)_d;
+    struct count_table *t = &args.tables[i];
+    int n_barcode = dict_size(args.barcodes);
+    int f;
+    for (f = d->start; f < d->end; ++f) {
+        if (t->ft_idx[f] == -1) continue;
+        uint32_t *row = d->val + (uint64_t)(f - d->start)*n_barcode;
+        kh_cell_t *v = dict_query_value(t->features, t->ft_idx[f]);
+        khint_t k;
+        for (k = kh_begin(v); k != kh_end(v); ++k) {
+            if (!kh_exist(v, k)) continue;
+            int c = args.whitelist_fname ? kh_key(v, k) : t->bc_map[kh_key(v, k)];
+            row[c] = kh_val(v, k).count;
         }
-        fclose(out);
-        free(temp);
     }
+}
 
+static inline int dense_format_u32(char *p, uint32_t x)
+{
+    static const char dig2[] =
+        "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+        "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+        "8081828384858687888990919293949596979899";
+    char buf[10];
+    int l = 0;
+    if (x == 0) {
+        *p = '0';
+        return 1;
+    }
+    while (x >= 100) {
+        const char *d = &dig2[2*(x%100)];
+        x /= 100;
+        buf[l++] = d[1];
+        buf[l++] = d[0];
+    }
+    if (x >= 10) {
+        buf[l++] = dig2[2*x+1];
+        buf[l++] = dig2[2*x];
+    }
+    else buf[l++] = '0' + x;
+    int i;
+    for (i = 0; i < l; ++i) p[i] = buf[l-1-i];
+    return l;
 }
 
-int count_matrix(int argc, char **argv)
+static void dense_format_row(void *_d, long i, int tid)
 {
-    double t_real;
-    t_real = realtime();
-    if (parse_args(argc, argv)) return bam_count_usage();
-        
-    bam1_t *b;
+    struct dense_block *d = (struct dense_block*)_d;
+    int n_barcode = dict_size(args.barcodes);
+    const char *name = dict_name(args.features, d->start + i);
+    uint32_t *row = d->val + (uint64_t)i*n_barcode;
+    kstring_t *str = &d->str[i];
+    str->l = 0;
+    ks_resize(str, strlen(name) + (uint64_t)n_barcode*11 + 2);
+    kputs(name, str);
+    char *p = str->s + str->l;
+    int j;
+    for (j = 0; j < n_barcode; ++j) {
+        *p++ = '\t';
+        p += dense_format_u32(p, row[j]);
+    }
+    *p++ = '\n';
+    str->l = p - str->s;
+}
 
-    int ret;
-    b = bam_init1();
-    int region_type_flag = 0;
+static void dense_write(void *fp, const void *data, size_t l)
+{
+    if (args.binary) {
+        if (bgzf_write((BGZF*)fp, data, l) != l) error("Failed to write %s.", args.output_fname);
+    }
+    else {
+        if (fwrite(data, 1, l, (FILE*)fp) != l) error("Failed to write %s.", args.output_fname);
+    }
+}
+
+#define DENSE_BLOCK_SIZE (1<<22) // counts in one block
+
+static void write_dense()
+{
+    int n_barcode = dict_size(args.barcodes);
+    int n_feature = dict_size(args.features);
+    int i;
+    void *fp;
+    if (args.binary) {
+        fp = bgzf_open(args.output_fname, "w");
+        CHECK_EMPTY(fp, "%s : %s.", args.output_fname, strerror(errno));
+        bgzf_mt(fp, args.n_thread, 256);
+    }
+    else {
+        fp = fopen(args.output_fname, "w");
+        CHECK_EMPTY(fp, "%s : %s.", args.output_fname, strerror(errno));
+    }
     
-    for (;;) {
-        //ret = sam_read1(args.fp_in, args.hdr, b);
-        ret = read_bam_files(args.files, b);
-        if (ret < 0) break;
-        bam_hdr_t *hdr = get_hdr(args.files);
+    // header
+    kstring_t str = {0,0,0};
+    if (args.binary) {
+        uint8_t hdr[32];
+        memcpy(hdr, "PISADNS\1", 8);
+        u32_to_le(1, hdr+8);  // version
+        u32_to_le(0, hdr+12); // layout
+        u64_to_le(n_feature, hdr+16);
+        u64_to_le(n_barcode, hdr+24);
+        kputsn((char*)hdr, 32, &str);
+        for (i = 0; i < n_barcode; ++i) kputsn(dict_name(args.barcodes, i), strlen(dict_name(args.barcodes, i))+1, &str);
+        for (i = 0; i < n_feature; ++i) kputsn(dict_name(args.features, i), strlen(dict_name(args.features, i))+1, &str);
+    }
+    else {
+        kputs("ID", &str);
+        for (i = 0; i < n_barcode; ++i) {
+            kputc('\t', &str);
+            kputs(dict_name(args.barcodes, i), &str);
+        }
+        kputc('\n', &str);
+    }
+    dense_write(fp, str.s, str.l);
+    free(str.s);
 
-        char *alias = get_alias(args.files);
-        if (args.alias_file_cb == 1 && !alias)
-            error("No alias found for %s", get_fname(args.files));
-        
-        bam1_core_t *c;
-        c = &b->core;
+    int rows = DENSE_BLOCK_SIZE/n_barcode;
+    if (rows < 1) rows = 1;
+    struct dense_block d;
+    d.val = malloc((uint64_t)rows*n_barcode*sizeof(uint32_t));
+    d.str = args.binary ? NULL : calloc(rows, sizeof(kstring_t));
+    for (d.start = 0; d.start < n_feature; d.start += rows) {
+        d.end = d.start + rows < n_feature ? d.start + rows : n_feature;
+        memset(d.val, 0, (uint64_t)(d.end - d.start)*n_barcode*sizeof(uint32_t));
+        for_each(dense_fill_shard, &d, args.n_shard);
+        if (args.binary) {
+            le_u32(d.val, (uint64_t)(d.end - d.start)*n_barcode);
+            dense_write(fp, d.val, (uint64_t)(d.end - d.start)*n_barcode*sizeof(uint32_t));
+            continue;
+        }
+        for_each(dense_format_row, &d, d.end - d.start);
+        for (i = 0; i < d.end - d.start; ++i) dense_write(fp, d.str[i].s, d.str[i].l);
+    }
+    
+    free(d.val);
+    if (d.str) {
+        for (i = 0; i < rows; ++i) free(d.str[i].s);
+        free(d.str);
+    }
+    if (args.binary) bgzf_close(fp);
+    else fclose(fp);
+}
 
-        if (c->tid <= -1 || c->tid > hdr->n_targets || (c->flag & BAM_FUNMAP)) continue;
-        if (c->qual < args.mapq_thres) continue;
-        if (args.use_dup == 0 && c->flag & BAM_FDUP) continue;
-        
-        if (args.n_type > 0) {
+static void write_outs()
+{
+    int n_barcode = dict_size(args.barcodes);
+    int n_feature = dict_size(args.features);
 
-            uint8_t *data = bam_aux_get(b, args.region_type_tag);
-            if (!data) continue;
+    if (n_barcode == 0) error("No barcode found.");
+    if (n_feature == 0) error("No feature found.");
+    if (args.n_record == 0) {
+        warnings("No anntated record found.");
+        return;
+    }
 
-            region_type_flag = 0;
-            int k;
-            for (k = 0; k < args.n_type; ++k) {
-                if (args.region_types[k] == RE_type_map(data[1])) {
-                    region_type_flag = 1;
-                    break;
-                }
-            }
+    if (args.outdir) {
+        kstring_t fname = {0,0,0};
+        out_path(&fname, "barcodes.tsv.gz");
+        write_names(fname.s, args.barcodes);
+        out_path(&fname, "features.tsv.gz");
+        write_names(fname.s, args.features);
 
-            if (region_type_flag == 0) continue;
+        kstring_t str = {0,0,0};
+        kstring_t name = {0,0,0};
+        BGZF *mex_fp[MAX_MATRIX];
+        int n = n_matrix();
+        int i;
+        for (i = 0; i < n; ++i) {
+            name.l = 0;
+            ksprintf(&name, "%s.mtx.gz", matrix_name(i));
+            out_path(&fname, name.s);
+            
+            if (args.cell_sorted) {
+                struct count_stream *st = args.stream;
+                bgzf_close(st->fp[i]);
+                st->fp[i] = NULL;
+                mex_patch_header(fname.s, st->fname[i].s, args.n_entry[i]);
+                continue;
+            }
+            mex_fp[i] = bgzf_open(fname.s, "w");
+            CHECK_EMPTY(mex_fp[i], "%s : %s.", fname.s, strerror(errno));
+            bgzf_mt(mex_fp[i], args.n_thread, 256);
+            str.l = 0;
+            mex_header(&str, args.n_entry[i]);
+            if (bgzf_write(mex_fp[i], str.s, str.l) != str.l) error("Failed to write.");
         }
+        free(name.s);
+        free(str.s);
+        free(fname.s);
+        if (args.cell_sorted) return;
         
-        count_matrix_core(b, alias);
+        // shards collect counts of one window, then parts of the window are formatted in parallel
+        // and written in order of features
+        int start;
+        for (start = 0; start < n_feature; start += WRITE_WINDOW) {
+            for_each(collect_shard, &start, args.n_shard);
+            for_each(format_part, &start, args.n_shard);
+            int j;
+            for (j = 0; j < args.n_shard; ++j) {
+                struct count_table *t = &args.tables[j];
+                for (i = 0; i < n; ++i) {
+                    if (t->str[i].l == 0) continue;
+                    int l = bgzf_write(mex_fp[i], t->str[i].s, t->str[i].l);
+                    if (l != t->str[i].l) error("Failed to write file.");
+                }
+            }
+        }
+
+        for (i = 0; i < n; ++i) bgzf_close(mex_fp[i]);
+
+        if (args.binary) write_bin();
     }
     
-    bam_destroy1(b);
+    if (args.output_fname) write_dense();
+}
+
+int count_matrix(int argc, char **argv)
+{
+    double t_real;
+    t_real = realtime();
+    if (parse_args(argc, argv)) return bam_count_usage();
+        
+    int i;
+    args.tables = malloc(args.n_shard*sizeof(struct count_table));
+    for (i = 0; i < args.n_shard; ++i) count_table_init(&args.tables[i]);
+    
+    if (args.cell_sorted) args.stream = count_stream_init();
+    
+    if (args.n_thread == 1) {
+        for (;;) {
+            struct count_chunk *c = count_chunk_read();
+            if (c == NULL) break;
+            count_pipeline(&args, 1, c);
+        }
+    }
+    else {
+        // stream mode needs records in order of input
+        if (args.files->n > 1 && args.cell_sorted == 0) {
+            int bits = 0;
+            while ((1<<bits) < args.files->n) bits++;
+            args.rec_bits = 48 - bits;
+            args.readers = file_readers_start(args.files->n < args.n_thread ? args.files->n : args.n_thread);
+        }
+        args.pool = kt_forpool_init(args.n_thread);
+        kt_pipeline(2, count_pipeline, &args, 2);
+        if (args.readers) {
+            file_readers_destroy(args.readers);
+            args.readers = NULL;
+            args.read_ret = -1; // checked by readers
+        }
+    }
     
-    if (ret != -1) warnings("Truncated file?");   
+    if (args.read_ret != -1) warnings("Truncated file?");   
 
-    update_counts();
+    if (args.cell_sorted) stream_flush();
+    else {
+        build_index();
+        update_counts();
+    }
 
     write_outs();
+
+    if (args.pool) {
+        kt_forpool_destroy(args.pool);
+        args.pool = NULL;
+    }
+    if (args.stream) count_stream_destroy(args.stream);
     
     memory_release();
     
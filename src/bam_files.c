@@ -63,12 +63,14 @@ struct bam_files *init_bam_list(const char *file_list, int n_thread)
     memset(files, 0, sizeof(struct bam_files));
     files->n_thread = n_thread;
     files->n = n;
-    files->files = malloc(sizeof(struct bam_file)*n);
+    files->files = calloc(n, sizeof(struct bam_file));
     
     kstring_t str = {0,0,0};
     
     int i;
     for (i = 0; i < n; ++i) {
+        struct bam_file *file = &files->files[i];
+        file->state = file_closed; // skipped lines
         str.l = 0;
         kputs(list[i], &str);
         free(list[i]);
@@ -79,8 +81,6 @@ struct bam_files *init_bam_list(const char *file_list, int n_thread)
         int c = 0;
         int *s = ksplit(&str, '\t', &c);
         if (c == 0) continue; // empty list
-        struct bam_file *file = &files->files[i];
-        memset(file, 0, sizeof(struct bam_file));
 
         file->state = file_not_open;
         file->fname = strdup(str.s);
@@ -112,12 +112,12 @@ void close_bam_files(struct bam_files *files)
 
 int read_bam_files(struct bam_files *files, bam1_t *b)
 {
-    struct bam_file *file = &files->files[files->i];
-    
-    while (file->state == file_closed && files->i < files->n) 
+    while (files->i < files->n && files->files[files->i].state == file_closed) 
         files->i++;
 
     if (files->i == files->n) return -1;
+
+    struct bam_file *file = &files->files[files->i];
     
     if (file->state == file_not_open) {
         file->fp = hts_open(file->fname, "r");
@@ -1,17 +1,21 @@
 #include "utils.h"
-#include "dict.h"
 #include "htslib/thread_pool.h"
 #include "htslib/sam.h"
 #include "htslib/bgzf.h"
 #include "htslib/kstring.h"
+#include "htslib/khash.h"
 #include "number.h"
 
+void kt_for(int n_threads, void (*func)(void*,long,int), void *data, long n);
+void kt_pipeline(int n_threads, void *(*func)(void*, int, void*), void *shared_data, int n_steps);
+
 static struct args {
     const char *input_fname;
     const char *output_fname;
     const char *report_fname;
     
     int file_thread;
+    int n_thread;
     int keep_dup;
     int qual_thres;
     int n_tag;
@@ -20,12 +24,19 @@ static struct args {
     BGZF *out;
     FILE *fp_report;
     bam_hdr_t *hdr;
+
+    // -t, each worker reads regions through its own file handle
+    htsFile **fps;
+    hts_idx_t **idxs;
+    int next_tid;
+    int64_t next_beg;
     //int as_SE;
 } args = {
     .input_fname  = NULL,
     .output_fname = NULL,
     .report_fname = NULL,
     .file_thread  = 5,
+    .n_thread     = 1,
     .keep_dup     = 0,
     .qual_thres   = 0,
     .n_tag        = 0,
@@ -34,6 +45,10 @@ static struct args {
     .out          = NULL,
     .fp_report    = NULL,
     .hdr          = NULL,
+    .fps          = NULL,
+    .idxs         = NULL,
+    .next_tid     = 0,
+    .next_beg     = 0,
     //.as_SE        = 0,
 };
 static int parse_args(int argc, char **argv)
@@ -42,6 +57,7 @@ static int parse_args(int argc, char **argv)
     
     const char *tag_str  = NULL;
     const char *file_thread = NULL;
+    const char *thread = NULL;
     const char *qual_thres = NULL;
     for (i = 1; i < argc; ) {
         const char *a = argv[i++];
@@ -52,6 +68,7 @@ static int parse_args(int argc, char **argv)
         else if (strcmp(a, "-report") == 0) var = &args.report_fname;
         else if (strcmp(a, "-tags") == 0 || strcmp(a, "-tag") == 0) var = &tag_str;
         else if (strcmp(a, "-@") == 0) var = &file_thread;
+        else if (strcmp(a, "-t") == 0) var = &thread;
         else if (strcmp(a, "-q") == 0) var = &qual_thres;
         else if (strcmp(a, "-k") == 0) {
             args.keep_dup = 1;
@@ -81,6 +98,8 @@ static int parse_args(int argc, char **argv)
     if (tag_str == NULL) error("No tag specified.");
 
     if (file_thread) args.file_thread = str2int((char*)file_thread);
+    if (thread) args.n_thread = str2int((char*)thread);
+    if (args.n_thread < 1) args.n_thread = 1;
     if (qual_thres) args.qual_thres = str2int((char*)qual_thres);
     
     kstring_t str = {0,0,0};
@@ -113,12 +132,42 @@ static int parse_args(int argc, char **argv)
     }
     args.out = bgzf_open(args.output_fname, "w");
     CHECK_EMPTY(args.out, "%s : %s.", args.output_fname, strerror(errno));
+    if (args.file_thread > 1)
+        bgzf_mt(args.out, args.file_thread, 256);
     if (bam_hdr_write(args.out, args.hdr) == -1) error("Failed to write SAM header.");
+
+    if (args.n_thread > 1) {
+        hts_idx_t *idx = sam_index_load(args.fp, args.input_fname);
+        if (idx == NULL) {
+            warnings("No index found for %s, deduplicate in one thread.", args.input_fname);
+            args.n_thread = 1;
+        }
+        else {
+            hts_idx_destroy(idx);
+            args.fps = malloc(args.n_thread*sizeof(htsFile*));
+            args.idxs = malloc(args.n_thread*sizeof(hts_idx_t*));
+            for (i = 0; i < args.n_thread; ++i) {
+                args.fps[i] = hts_open(args.input_fname, "r");
+                CHECK_EMPTY(args.fps[i], "%s : %s.", args.input_fname, strerror(errno));
+                args.idxs[i] = sam_index_load(args.fps[i], args.input_fname);
+                CHECK_EMPTY(args.idxs[i], "Failed to load index of %s.", args.input_fname);
+            }
+        }
+    }
     
     return 0;
 }
 static void memory_release()
 {
+    if (args.fps) {
+        int i;
+        for (i = 0; i < args.n_thread; ++i) {
+            hts_idx_destroy(args.idxs[i]);
+            hts_close(args.fps[i]);
+        }
+        free(args.idxs);
+        free(args.fps);
+    }
     hts_close(args.fp);
     bgzf_close(args.out);
     bam_hdr_destroy(args.hdr);
@@ -128,8 +177,8 @@ static void memory_release()
     if (args.fp_report) fclose(args.fp_report);
 }
 
-static int all_reads = 0;
-static int duplicate = 0;
+static uint64_t all_reads = 0;
+static uint64_t duplicate = 0;
 
 static inline int sum_qual(const bam1_t *b)
 {
@@ -138,150 +187,307 @@ static inline int sum_qual(const bam1_t *b)
     for (i = q = 0; i < b->core.l_qseq; ++i) q += qual[i];
     return q;
 }
-static inline char *pick_tag_name(const bam1_t *b, int n_tag, char **tags)
+// pack tag values to a reused key
+static inline void pick_tag_key(const bam1_t *b, kstring_t *str)
 {
     const bam1_core_t *c = &b->core;
-    kstring_t str = {0,0,0};
     int i;
+    str->l = 0;
     for (i = 0; i < args.n_tag; ++i) {
         uint8_t *tag = bam_aux_get(b, args.tags[i]);        
         if (!tag){
-            error("No %s tag at alignment. %d:%lld", args.tags[i], c->tid, c->pos+1);
-            //if (str.l) free(str.s);
-            //return NULL;
+            error("No %s tag at alignment. %d:%lld", args.tags[i], c->tid, (long long)c->pos+1);
         }
-        kputs((char*)tag, &str);
+        kputs((char*)tag, str);
     }
-    return str.s;
 }
 
 struct rcd {
-    bam1_t *b;
-    int idx;
+    bam1_t *b; // owned by the slot, recycled by next positions
+    int skip;
     int qual;
     int dup;
-    int checked;
+    kstring_t key; // kept with the slot, reused by next positions
 };
 
-static struct {
+// key -> best record of the group at current position
+KHASH_MAP_INIT_STR(grp, int)
+
+// Records at the same position are buffered and deduplicated together. Records kept are written
+// to out, or moved to bam[] in order for region workers.
+struct dedup {
     int n, m;
     struct rcd  *r;
-    struct dict *bcs;
-} buf = {
-    .n = 0,
-    .m = 0,
-    .r = NULL,
-    .bcs = NULL,
+    kh_grp_t *grp;
+
+    int last_tid;
+    hts_pos_t last_pos;
+    
+    uint64_t all_reads;
+    uint64_t duplicate;
+
+    BGZF *out;
+    int n_out, m_out;
+    bam1_t **bam;
 };
 
+static void dedup_init(struct dedup *d, BGZF *out)
+{
+    memset(d, 0, sizeof(*d));
+    d->last_tid = -2;
+    d->last_pos = -1;
+    d->out = out;
+    d->grp = kh_init(grp);
+}
+
 void reset_rcd(struct rcd *r)
 {
-    r->b = NULL;
-    r->idx = -1;
+    r->skip = 1;
     r->qual = -1;
     r->dup = 0;
-    r->checked = 0;
+    r->key.l = 0;
 }
-static void clean_buffer()
+static void clean_buffer(struct dedup *d)
 {
     int i;
-    for (i = 0; i < buf.n; ++i) {
-        bam_destroy1(buf.r[i].b);
-        reset_rcd(&buf.r[i]);
-    }
-    buf.n = 0;
-    if (buf.bcs) dict_destroy(buf.bcs);
-    buf.bcs = NULL;
+    for (i = 0; i < d->n; ++i) reset_rcd(&d->r[i]);
+    d->n = 0;
+    kh_clear(grp, d->grp);
 }
 
-static void destroy_buffer()
+static void destroy_buffer(struct dedup *d)
 {
-    if (buf.m) free(buf.r);
+    int i;
+    for (i = 0; i < d->m; ++i) {
+        if (d->r[i].b) bam_destroy1(d->r[i].b);
+        if (d->r[i].key.m) free(d->r[i].key.s);
+    }
+    if (d->m) free(d->r);
+    kh_destroy(grp, d->grp);
 }
-static void push_buffer(bam1_t *b)
+// record is moved into the buffer, *b is replaced by a recycled record
+static void push_buffer(struct dedup *d, bam1_t **_b)
 {
-    if (buf.n == buf.m) {
-        buf.m = buf.n == 0 ? 12 : buf.m * 2;
-        buf.r = realloc(buf.r, buf.m *sizeof(struct rcd));
+    if (d->n == d->m) {
+        d->m = d->n == 0 ? 12 : d->m * 2;
+        d->r = realloc(d->r, d->m *sizeof(struct rcd));
+        memset(d->r + d->n, 0, (d->m - d->n)*sizeof(struct rcd));
     }
-    struct rcd *r = &buf.r[buf.n];
+    struct rcd *r = &d->r[d->n];
     reset_rcd(r);
-    r->b = bam_dup1(b);
+    bam1_t *b = *_b;
+    *_b = r->b ? r->b : bam_init1();
+    r->b = b;
     bam1_core_t *c = &b->core;
-    if (c->qual < args.qual_thres) r->idx = -1;
+    if (c->qual < args.qual_thres) r->skip = 1;
     else if (c->flag & BAM_FQCFAIL || c->flag & BAM_FSECONDARY || c->flag & BAM_FSUPPLEMENTARY)
-        r->idx = -1;
+        r->skip = 1;
     else {
+        r->skip = 0;
         r->qual = sum_qual(b);
-        r->dup = 0;
-        
-        char *bc = pick_tag_name(b, args.n_tag, args.tags);
-        if (buf.bcs == NULL) buf.bcs = dict_init();
-        r->idx = dict_query(buf.bcs, bc);
-        if (r->idx == -1) r->idx = dict_push(buf.bcs, bc);
-        free(bc);
+        pick_tag_key(b, &r->key);
     }
-    buf.n++;
+    d->n++;
 }
-static void dump_best()
+static void dedup_write(struct dedup *d, struct rcd *r)
 {
-    if (buf.n == 0) return;
-    int i, j;
-    for (i = 0; i < buf.n; ++i) {
-        struct rcd *r1 = &buf.r[i];
-        if (r1->idx == -1) continue;
-        if (r1->checked == 1) continue;
-        int best = i;
-        for (j = i+1; j < buf.n; ++j) {
-            struct rcd *r2 = &buf.r[j];
-            if (r2->idx == -1 || r2->checked == 1) continue;
-            if (r2->idx != r1->idx) continue;
-            r1 = &buf.r[best];
-            if (r2->qual > r1->qual) {
-                best = j; // update the best quality
-                r1->dup = 1; // mark last best one dup
-            } else {
-                r2->dup = 1; // mark current one dup
-            }
-            r2->checked = 1;
+    if (d->out) {
+        if (bam_write1(d->out, r->b) == -1) error("Failed to write.");
+        return;
+    }
+    if (d->n_out == d->m_out) {
+        d->m_out = d->m_out == 0 ? 1024 : d->m_out*2;
+        d->bam = realloc(d->bam, d->m_out*sizeof(bam1_t*));
+    }
+    d->bam[d->n_out++] = r->b;
+    r->b = NULL; // moved
+}
+static void dump_best(struct dedup *d)
+{
+    if (d->n == 0) return;
+    int i, ret;
+    khint_t k;
+    // the first record with the highest quality is kept in each group
+    for (i = 0; i < d->n; ++i) {
+        struct rcd *r = &d->r[i];
+        if (r->skip) continue;
+        k = kh_put(grp, d->grp, r->key.s, &ret);
+        if (ret != 0) {
+            kh_val(d->grp, k) = i;
+            continue;
+        }
+        struct rcd *best = &d->r[kh_val(d->grp, k)];
+        if (r->qual > best->qual) {
+            best->dup = 1;
+            kh_val(d->grp, k) = i;
+        }
+        else {
+            r->dup = 1;
         }
     }
 
-    for (i = 0; i < buf.n; ++i) {
-        struct rcd *r = &buf.r[i];
-        //LOG_print("idx,%d\tdup,%d\tchecked:%d", r->idx, r->dup, r->checked);
+    for (i = 0; i < d->n; ++i) {
+        struct rcd *r = &d->r[i];
         if (r->b->core.qual < args.qual_thres) continue;
-        if (r->idx != -1) all_reads++;
+        if (r->skip == 0) d->all_reads++;
         if (r->dup == 1) {
-            duplicate++;
+            d->duplicate++;
             if (args.keep_dup == 0) continue;
             r->b->core.flag |= BAM_FDUP;
-            if (bam_write1(args.out, r->b) == -1) error("Failed to write.");
+            dedup_write(d, r);
         } else {
-            
-            if (bam_write1(args.out, r->b) == -1) error("Failed to write.");
+            dedup_write(d, r);
         }
     }
     
-    clean_buffer();
+    clean_buffer(d);
+}
+// records should be sorted by coordinate
+static void dedup_record(struct dedup *d, bam1_t **b)
+{
+    const bam1_core_t *c = &(*b)->core;
+    if (d->last_tid != c->tid) {
+        d->last_tid = c->tid;
+        d->last_pos = -1;
+        dump_best(d);
+    }
+
+    if (d->last_pos == -1) {
+        d->last_pos = c->pos;
+    }
+    else if (d->last_pos == c->pos) {
+        // just push to buffer
+    }
+    else if (d->last_pos < c->pos) {
+        dump_best(d);
+    }
+    else {
+        error("Unsorted bam?");
+    }
+    d->last_pos = c->pos;
+    push_buffer(d, b);
 }
-static void print_unmapped(bam1_t *b)
+static void print_unmapped(struct dedup *d, bam1_t *b)
 {
-    dump_best();
+    dump_best(d);
     if (bam_write1(args.out, b) == -1)
         error("Failed to write.");
 }
 static void summary_report()
 {
     if (args.fp_report) {
-        fprintf(args.fp_report, "All reads,%d\n", all_reads);
-        fprintf(args.fp_report, "Duplicate reads,%d\n", duplicate);
-        fprintf(args.fp_report, "Duplicate ratio,%.4f\n", (float)duplicate/all_reads);
+        fprintf(args.fp_report, "All reads,%"PRIu64"\n", all_reads);
+        fprintf(args.fp_report, "Duplicate reads,%"PRIu64"\n", duplicate);
+        fprintf(args.fp_report, "Duplicate ratio,%.4f\n", (double)duplicate/all_reads);
     }
-    LOG_print("All reads,%d", all_reads);
-    LOG_print("Duplicate reads,%d", duplicate);
-    LOG_print("Duplicate ratio,%.4f", (float)duplicate/all_reads);
+    LOG_print("All reads,%"PRIu64, all_reads);
+    LOG_print("Duplicate reads,%"PRIu64, duplicate);
+    LOG_print("Duplicate ratio,%.4f", (double)duplicate/all_reads);
 }
+
+// -t, contigs are split into windows and deduplicated by workers through the BAM index. Records
+// are grouped by position, so no group spans two windows. Records of a window are kept in memory
+// and written in order of windows.
+#define RMDUP_WINDOW 1000000
+#define RMDUP_BATCH  4 // windows per worker in one batch
+
+struct region {
+    int tid;
+    int64_t beg, end;
+    struct dedup d;
+};
+
+struct region_batch {
+    int n;
+    struct region *r;
+};
+
+static void region_worker(void *_d, long i, int tid)
+{
+    struct region_batch *batch = (struct region_batch*)_d;
+    struct region *r = &batch->r[i];
+    dedup_init(&r->d, NULL);
+    
+    hts_itr_t *itr = sam_itr_queryi(args.idxs[tid], r->tid, r->beg, r->end);
+    if (itr == NULL) {
+        destroy_buffer(&r->d);
+        return;
+    }
+    bam1_t *b = bam_init1();
+    int ret;
+    while ((ret = sam_itr_next(args.fps[tid], itr, b)) >= 0) {
+        if (b->core.pos < r->beg) continue; // start in last window
+        if (b->core.qual < args.qual_thres) continue;
+        dedup_record(&r->d, &b);
+    }
+    if (ret < -1) error("Failed to read %s.", args.input_fname);
+    dump_best(&r->d);
+    destroy_buffer(&r->d);
+    bam_destroy1(b);
+    hts_itr_destroy(itr);
+}
+
+static void *region_pipeline(void *shared, int step, void *_d)
+{
+    if (step == 0) {
+        if (args.next_tid >= args.hdr->n_targets) return NULL;
+        struct region_batch *batch = malloc(sizeof(*batch));
+        batch->n = 0;
+        batch->r = malloc(args.n_thread*RMDUP_BATCH*sizeof(struct region));
+        while (batch->n < args.n_thread*RMDUP_BATCH && args.next_tid < args.hdr->n_targets) {
+            struct region *r = &batch->r[batch->n++];
+            r->tid = args.next_tid;
+            r->beg = args.next_beg;
+            r->end = r->beg + RMDUP_WINDOW;
+            if (r->end >= args.hdr->target_len[r->tid]) {
+                r->end = HTS_POS_MAX; // records may be out of contig
+                args.next_tid++;
+                args.next_beg = 0;
+            }
+            else args.next_beg = r->end;
+        }
+        kt_for(args.n_thread, region_worker, batch, batch->n);
+        return batch;
+    }
+
+    struct region_batch *batch = (struct region_batch*)_d;
+    int i, j;
+    for (i = 0; i < batch->n; ++i) {
+        struct region *r = &batch->r[i];
+        if (r->beg == 0) LOG_print("Deduplicating %s", args.hdr->target_name[r->tid]);
+        for (j = 0; j < r->d.n_out; ++j) {
+            if (bam_write1(args.out, r->d.bam[j]) == -1) error("Failed to write.");
+            bam_destroy1(r->d.bam[j]);
+        }
+        free(r->d.bam);
+        all_reads += r->d.all_reads;
+        duplicate += r->d.duplicate;
+    }
+    free(batch->r);
+    free(batch);
+    return NULL;
+}
+
+static void rmdup_regions()
+{
+    kt_pipeline(2, region_pipeline, NULL, 2);
+
+    // unmapped reads at the end
+    hts_idx_t *idx = sam_index_load(args.fp, args.input_fname);
+    CHECK_EMPTY(idx, "Failed to load index of %s.", args.input_fname);
+    hts_itr_t *itr = sam_itr_queryi(idx, HTS_IDX_NOCOOR, 0, 0);
+    bam1_t *b = bam_init1();
+    if (itr) {
+        while (sam_itr_next(args.fp, itr, b) >= 0) {
+            if (b->core.qual < args.qual_thres) continue;
+            if (bam_write1(args.out, b) == -1) error("Failed to write.");
+        }
+        hts_itr_destroy(itr);
+    }
+    bam_destroy1(b);
+    hts_idx_destroy(idx);
+}
+
 extern int rmdup_usage();
 
 int bam_rmdup(int argc, char **argv)
@@ -291,48 +497,40 @@ int bam_rmdup(int argc, char **argv)
 
     if (parse_args(argc, argv)) return rmdup_usage();
 
+    if (args.n_thread > 1) {
+        rmdup_regions();
+        summary_report();
+        memory_release();
+        LOG_print("Real time: %.3f sec; CPU: %.3f sec", realtime() - t_real, cputime());
+        return 0;
+    }
+    
     bam1_t *b = bam_init1();
-    const bam1_core_t *c = &b->core;
+    const bam1_core_t *c;
     int ret;
-    int last_tid = -2;
-    int last_pos = -1;
+    struct dedup d;
+    dedup_init(&d, args.out);
 
     for (;;) {
         ret = sam_read1(args.fp, args.hdr, b);
         if (ret < 0) break; // end of file
+        c = &b->core;
 
         if (c->qual < args.qual_thres) continue;
         
         // assume inputs are sorted
         if (c->tid == -1) {
-            print_unmapped(b);
+            print_unmapped(&d, b);
             continue;
         }
 
-        if (last_tid != c->tid) {
-            LOG_print("Deduplicating %s", args.hdr->target_name[c->tid]);
-            last_tid = c->tid;
-            last_pos = -1;
-            dump_best();
-        }
-
-        if (last_pos == -1) {
-            last_pos = c->pos;
-        }
-        else if (last_pos == c->pos) {
-            // just push to buffer
-        }
-        else if (last_pos < c->pos) {
-            dump_best();
-        }
-        else {
-            error("Unsorted bam?");
-        }
-        last_pos = c->pos;
-        push_buffer(b);
+        if (d.last_tid != c->tid) LOG_print("Deduplicating %s", args.hdr->target_name[c->tid]);
+        dedup_record(&d, &b);
     }
-    dump_best();
-    destroy_buffer();
+    dump_best(&d);
+    destroy_buffer(&d);
+    all_reads = d.all_reads;
+    duplicate = d.duplicate;
     
     summary_report();
     
@@ -1,30 +1,46 @@
 #include "utils.h"
 #include "htslib/sam.h"
 #include "htslib/hts.h"
+#include "htslib/bgzf.h"
 #include "bam_pool.h"
 #include "htslib/kstring.h"
 #include "number.h"
 #include "htslib/thread_pool.h"
 #include "thread.h"
 #include "dict.h"
+#include "umi_set.h"
 #include "htslib/khash.h"
 
 // maximal hamming distance of two similar UMI
 #define UMI_E 1
 
+// UMI network methods, see -method
+#define UMI_CLUSTER     0
+#define UMI_ADJACENCY   1
+#define UMI_DIRECTIONAL 2
+
 extern char *compactDNA(const char *a, int l);
-extern int   compDNA_hamming_distance(const char *a, const char *b);
-extern char *compDNA_decode(const char *a);
+extern const char compDNA_str[];
+
+void kt_for(int n_threads, void (*func)(void*,long,int), void *data, long n);
+void kt_pipeline(int n_threads, void *(*func)(void*, int, void*), void *shared_data, int n_steps);
 
 typedef struct umi_count {
     int count; 
-    int index; // index refer to umi dict
+    uint64_t index; // key of (corrected) UMI
     int umi_index; // index to similiar UMIs group
     int primary;
     int filter;
 } uc_t;
 
-KHASH_MAP_INIT_STR(bc, uc_t)
+// UMIs up to 31 bp of A, C, G and T are 2-bit packed as key. Other UMIs are kept as compact
+// strings in the UMI dict of the cell, key is the dict index with UMI_STR_KEY set.
+#define UMI_PACK_MAX 31
+#define UMI_STR_KEY  (1ULL<<63)
+
+KHASH_MAP_INIT_INT64(bc, uc_t)
+KHASH_MAP_INIT_INT64(umi_ptr, struct umi_count*)
+KHASH_SET_INIT_INT64(pfx)
 
 // To correct UMI needs first cache all UMIs and grouped by predefined barcodes, such as cell and gene.
 // For example, if set -tags-block to "CB,GN", this will group reads from the same cell barcode and gene
@@ -40,10 +56,67 @@ struct tag_val {
 };
 
 struct bc_corr {
-    struct dict    *umi_val; // UMIs
+    int             umi_len; // all UMIs in one cell should be equal length
+    struct dict    *umi_val; // UMIs can not be packed
     struct tag_val *val;
 };
 
+// return 0 and key of UMI, or -1 if UMI not indexed
+static int umi_key(struct bc_corr *bc, const char *umi, int push, uint64_t *key)
+{
+    int l = strlen(umi);
+    if (l != bc->umi_len) return -1;
+    if (l <= UMI_PACK_MAX && umi_pack(umi, l, key) == 0) return 0;
+
+    char *comp = compactDNA(umi, l);
+    int id = push ? dict_push(bc->umi_val, comp) : dict_query(bc->umi_val, comp);
+    free(comp);
+    if (id < 0) return -1;
+    *key = UMI_STR_KEY | id;
+    return 0;
+}
+
+// decode UMI to reused buffer
+static char *umi_decode(struct bc_corr *bc, uint64_t key, kstring_t *str)
+{
+    str->l = 0;
+    if (key & UMI_STR_KEY) {
+        const uint8_t *a = (const uint8_t*)dict_name(bc->umi_val, key & ~UMI_STR_KEY);
+        for (; *a; ++a) {
+            kputc(compDNA_str[*a>>4], str);
+            if (*a & 0xf) kputc(compDNA_str[*a&0xf], str); // low 4 bits of last byte is 0 for odd length
+        }
+        return str->s;
+    }
+    ks_resize(str, bc->umi_len+1);
+    int i;
+    for (i = bc->umi_len-1; i >= 0; --i, key >>= 2) str->s[i] = "ACGT"[key&3];
+    str->l = bc->umi_len;
+    str->s[str->l] = '\0';
+    return str->s;
+}
+
+// 4-bit code of base i, same as compactDNA, A=1, C=2, G=4, T=8
+static inline int umi_code(struct bc_corr *bc, uint64_t key, const uint8_t *s, int i)
+{
+    if (s) return i&1 ? s[i>>1]&0xf : s[i>>1]>>4;
+    return 1 << (key >> 2*(bc->umi_len-1-i) & 3);
+}
+
+static int umi_distance(struct bc_corr *bc, uint64_t a, uint64_t b)
+{
+    if (((a|b) & UMI_STR_KEY) == 0) {
+        uint64_t x = a ^ b;
+        return __builtin_popcountll((x | x>>1) & 0x5555555555555555ULL);
+    }
+    // ambiguous bases, compare compact codes
+    const uint8_t *s0 = a & UMI_STR_KEY ? (const uint8_t*)dict_name(bc->umi_val, a & ~UMI_STR_KEY) : NULL;
+    const uint8_t *s1 = b & UMI_STR_KEY ? (const uint8_t*)dict_name(bc->umi_val, b & ~UMI_STR_KEY) : NULL;
+    int i, e = 0;
+    for (i = 0; i < bc->umi_len; ++i) e += umi_code(bc, a, s0, i) != umi_code(bc, b, s1, i);
+    return e;
+}
+
 void bc_corr_destroy1(struct dict *bc)
 {
     int i;
@@ -73,20 +146,17 @@ void bc_corr_destroy(struct dict *C)
     dict_destroy(C);
 }
 
-// this function return a array of sam attributions, values of this array are actually point to SAM::data, so don't free them
-char **sam_tag_values(bam1_t *b, int n, const char **blocks)
+// fill v with sam attributions, values of this array are actually point to SAM::data, so don't free them
+// return -1 if any tag is missing
+int sam_tag_values(bam1_t *b, int n, const char **blocks, char **v)
 {
-    char **v = malloc(n*sizeof(void*));
     int i;
     for (i = 0; i <n; ++i) {
         char *v0 = (char*)bam_aux_get(b, blocks[i]);
-        if (!v0) {
-            free(v);
-            return NULL;
-        }
+        if (!v0) return -1;
         v[i] = v0+1; // skip the type character
     }
-    return v;
+    return 0;
 }
 
 static struct args {
@@ -110,9 +180,19 @@ static struct args {
     int           file_th;
     
     int           chunk_size;
-    struct dict * Cindex;
+    int           n_shard;
+    struct dict **Cindex; // sharded by cell barcode
 
     int           e_distance;
+    int           method;
+
+    int64_t       mem; // -m, memory cap of index
+    const char  * prefix;
+
+    int           cell_sorted;
+    struct dict * done_cells; // -cell-sorted, cells already written
+    bam1_t        next; // -cell-sorted, first record of next chunk
+    int           has_next;
 } args = {
     .input_fname  = NULL,
     .output_fname = NULL,
@@ -128,8 +208,15 @@ static struct args {
     .file_th      = 4,
 
     .chunk_size   = 1000000, //1M
+    .n_shard      = 1,
     .Cindex       = NULL,
     .e_distance   = UMI_E,
+    .method       = UMI_CLUSTER,
+    .mem          = 0,
+    .prefix       = NULL,
+    .cell_sorted  = 0,
+    .done_cells   = NULL,
+    .has_next     = 0,
 };
 
 static void memory_release()
@@ -140,7 +227,11 @@ static void memory_release()
     int i;
     for (i = 0; i < args.n_block; ++i) free(args.blocks[i]);
     free(args.blocks);
-    bc_corr_destroy(args.Cindex);
+    if (args.Cindex) {
+        for (i = 0; i < args.n_shard; ++i) bc_corr_destroy(args.Cindex[i]);
+        free(args.Cindex);
+    }
+    if (args.done_cells) dict_destroy(args.done_cells);
 }
 static void umi_idx_refresh(kh_bc_t *val, int old_idx, int new_idx)
 {
@@ -159,7 +250,7 @@ static void umi_idx_correct(kh_bc_t *val)
         struct umi_count *cnt = &kh_val(val, k);
         if (cnt->umi_index <= 0) continue; // corrected or no need to correct
 
-        int best_umi = cnt->index;
+        uint64_t best_umi = cnt->index;
         int best_cnt = cnt->count;
 
         // check the best UMI
@@ -191,30 +282,35 @@ static void umi_idx_correct(kh_bc_t *val)
     }
 }
 
-void build_index_core(struct tag_val *tag_val, struct dict *umi_val)
+struct umi_order {
+    khiter_t k;
+    int count;
+};
+
+static int cmp_umi_order(const void *_a, const void *_b)
 {
-    if (tag_val->bc != NULL) { //iterate next tag
-        int i;
-        for (i = 0; i < dict_size(tag_val->bc); ++i) {
-            char *name = dict_name(tag_val->bc, i);
-            int id = dict_query(tag_val->bc, name);
-            struct tag_val *v = dict_query_value(tag_val->bc, id);
-            build_index_core(v, umi_val);
-        }
-        return;
-    }
+    const struct umi_order *a = _a;
+    const struct umi_order *b = _b;
+    if (a->count != b->count) return b->count - a->count;
+    return a->k < b->k ? -1 : a->k > b->k;
+}
 
-    // UMI correction, O(n^2)
-    kh_bc_t *val = tag_val->val;
+static int cmp_rank(const void *a, const void *b)
+{
+    return *(const int*)a - *(const int*)b;
+}
+
+// UMI correction, O(n^2), for small groups or hamming distance greater than 1
+static void umi_cluster_pairwise(struct bc_corr *bc, kh_bc_t *val)
+{
     khiter_t k;
-    
     int umi_idx = 1;
 
     for (k = kh_begin(val); k != kh_end(val); ++k) {
         if (!kh_exist(val, k)) continue;
         
         struct umi_count *cnt = &kh_val(val, k);
-        const char *a = kh_key(val, k);
+        uint64_t a = kh_key(val, k);
         
         khiter_t k1;
         for (k1 = k+1; k1 != kh_end(val); ++k1) {
@@ -224,8 +320,7 @@ void build_index_core(struct tag_val *tag_val, struct dict *umi_val)
             if (cnt1->umi_index == umi_idx) continue; // umi_idx already updated and refreshed            
             
             // check similarity of two UMIs
-            const char *b = kh_key(val, k1);
-            int e = compDNA_hamming_distance(a, b);
+            int e = umi_distance(bc, a, kh_key(val, k1));
             if (e > args.e_distance) continue;
             
             if (cnt->umi_index == 0) cnt->umi_index = umi_idx; // init the UMI index; if no similar UMI, umi_index == 0
@@ -240,12 +335,269 @@ void build_index_core(struct tag_val *tag_val, struct dict *umi_val)
 
     umi_idx_correct(val);
 }
+
+// Similar UMIs of one UMI are found by enumerating all its 1-mismatch neighbors and looking them
+// up in the hash, or by scanning all UMIs if hamming distance greater than 1 or group is small.
+struct umi_graph {
+    struct bc_corr *bc;
+    kh_bc_t  *val;
+    int       n;
+    int       l;
+    int       scan;
+    khiter_t *str; // UMIs can not be packed
+    int       n_str;
+    khiter_t *nb; // neighbors of last query
+    int       n_nb;
+};
+
+static void umi_graph_init(struct umi_graph *g, struct bc_corr *bc, kh_bc_t *val, int n)
+{
+    memset(g, 0, sizeof(*g));
+    g->bc = bc;
+    g->val = val;
+    g->n = n;
+    g->l = bc->umi_len;
+    g->str = malloc(n*sizeof(khiter_t));
+    khiter_t k;
+    for (k = kh_begin(val); k != kh_end(val); ++k)
+        if (kh_exist(val, k) && kh_key(val, k) & UMI_STR_KEY) g->str[g->n_str++] = k;
+    // pairwise comparison is cheaper for small groups
+    g->scan = args.e_distance > 1 || n-1 <= (g->l*3 + g->n_str)*2;
+    g->nb = malloc(n*sizeof(khiter_t));
+}
+
+static void umi_graph_destroy(struct umi_graph *g)
+{
+    free(g->str);
+    free(g->nb);
+}
+
+static int umi_graph_neighbors(struct umi_graph *g, khiter_t k0)
+{
+    kh_bc_t *val = g->val;
+    uint64_t a = kh_key(val, k0);
+    khiter_t k1;
+    int j, c;
+    g->n_nb = 0;
+    if (g->scan || a & UMI_STR_KEY) {
+        for (k1 = kh_begin(val); k1 != kh_end(val); ++k1) {
+            if (!kh_exist(val, k1) || k1 == k0) continue;
+            if (umi_distance(g->bc, a, kh_key(val, k1)) > args.e_distance) continue;
+            g->nb[g->n_nb++] = k1;
+        }
+        return g->n_nb;
+    }
+    
+    for (j = 0; j < g->l; ++j) {
+        for (c = 1; c < 4; ++c) {
+            k1 = kh_get(bc, val, a ^ (uint64_t)c << j*2);
+            if (k1 != kh_end(val)) g->nb[g->n_nb++] = k1;
+        }
+    }
+    for (j = 0; j < g->n_str; ++j)
+        if (umi_distance(g->bc, a, kh_key(val, g->str[j])) <= args.e_distance) g->nb[g->n_nb++] = g->str[j];
+    return g->n_nb;
+}
+
+// UMIs sorted by count, the first UMI of each group is the one with the highest count
+static struct umi_order *umi_graph_order(struct umi_graph *g)
+{
+    struct umi_order *a = malloc(g->n*sizeof(*a));
+    int i = 0;
+    khiter_t k;
+    for (k = kh_begin(g->val); k != kh_end(g->val); ++k) {
+        if (!kh_exist(g->val, k)) continue;
+        a[i].k = k;
+        a[i].count = kh_val(g->val, k).count;
+        i++;
+    }
+    qsort(a, g->n, sizeof(*a), cmp_umi_order);
+    return a;
+}
+
+static void umi_correct_to(kh_bc_t *val, khiter_t best, khiter_t k)
+{
+    struct umi_count *cnt = &kh_val(val, k);
+    cnt->index = kh_val(val, best).index;
+    cnt->primary = 0;
+    cnt->umi_index = -1;
+    kh_val(val, best).umi_index = -1; // checked
+}
+
+// All UMIs linked to each other are corrected to the UMI with the highest count. Same groups as pairwise.
+static void umi_cluster_neighbor(struct bc_corr *bc, kh_bc_t *val, int n)
+{
+    struct umi_graph g;
+    umi_graph_init(&g, bc, val, n);
+    struct umi_order *a = umi_graph_order(&g);
+    uint8_t *done = calloc(kh_end(val), 1);
+    khiter_t *queue = malloc(n*sizeof(khiter_t));
+    int i, j;
+    
+    for (i = 0; i < n; ++i) {
+        if (done[a[i].k]) continue;
+        int n_queue = 0, q = 0;
+        done[a[i].k] = 1;
+        queue[n_queue++] = a[i].k;
+        while (q < n_queue) {
+            umi_graph_neighbors(&g, queue[q++]);
+            for (j = 0; j < g.n_nb; ++j) {
+                khiter_t k1 = g.nb[j];
+                if (done[k1]) continue;
+                done[k1] = 1;
+                queue[n_queue++] = k1;
+                umi_correct_to(val, a[i].k, k1);
+            }
+        }
+    }
+    free(queue);
+    free(done);
+    free(a);
+    umi_graph_destroy(&g);
+}
+
+// UMI-tools directional method. UMI a links to b if count(a) >= 2*count(b)-1. Starting from UMIs of
+// the highest count, all UMIs reachable by such links and not grouped yet are corrected to it.
+static void umi_cluster_directional(struct bc_corr *bc, kh_bc_t *val, int n)
+{
+    struct umi_graph g;
+    umi_graph_init(&g, bc, val, n);
+    struct umi_order *a = umi_graph_order(&g);
+    uint8_t *done = calloc(kh_end(val), 1);
+    int *visit = calloc(kh_end(val), sizeof(int)); // search id, one search does not visit UMI twice
+    khiter_t *queue = malloc(n*sizeof(khiter_t));
+    int i, j;
+    
+    for (i = 0; i < n; ++i) {
+        if (done[a[i].k]) continue;
+        int n_queue = 0, q = 0;
+        done[a[i].k] = 1;
+        visit[a[i].k] = i+1;
+        queue[n_queue++] = a[i].k;
+        while (q < n_queue) {
+            khiter_t k0 = queue[q++];
+            int count = kh_val(val, k0).count;
+            umi_graph_neighbors(&g, k0);
+            for (j = 0; j < g.n_nb; ++j) {
+                khiter_t k1 = g.nb[j];
+                if (visit[k1] == i+1) continue;
+                if (count < 2*kh_val(val, k1).count - 1) continue;
+                visit[k1] = i+1;
+                queue[n_queue++] = k1;
+                // UMIs already grouped are passed through, but not corrected again
+                if (done[k1]) continue;
+                done[k1] = 1;
+                umi_correct_to(val, a[i].k, k1);
+            }
+        }
+    }
+    free(queue);
+    free(visit);
+    free(done);
+    free(a);
+    umi_graph_destroy(&g);
+}
+
+// UMI-tools adjacency method. For each group of linked UMIs, the fewest UMIs of the highest counts
+// which together with their neighbors cover the group are selected. Other UMIs are corrected to the
+// first selected UMI they are linked to.
+static void umi_cluster_adjacency(struct bc_corr *bc, kh_bc_t *val, int n)
+{
+    struct umi_graph g;
+    umi_graph_init(&g, bc, val, n);
+    struct umi_order *a = umi_graph_order(&g);
+    int *rank = malloc(kh_end(val)*sizeof(int));
+    uint8_t *done = calloc(kh_end(val), 1);
+    uint8_t *cover = calloc(kh_end(val), 1);
+    int *group = malloc(n*sizeof(int));
+    int i, j, m;
+    for (i = 0; i < n; ++i) rank[a[i].k] = i;
+    
+    for (i = 0; i < n; ++i) {
+        if (done[a[i].k]) continue;
+        // connected UMIs
+        int n_group = 0, q = 0;
+        done[a[i].k] = 1;
+        group[n_group++] = i;
+        while (q < n_group) {
+            umi_graph_neighbors(&g, a[group[q++]].k);
+            for (j = 0; j < g.n_nb; ++j) {
+                if (done[g.nb[j]]) continue;
+                done[g.nb[j]] = 1;
+                group[n_group++] = rank[g.nb[j]];
+            }
+        }
+        if (n_group == 1) continue;
+        qsort(group, n_group, sizeof(int), cmp_rank);
+        
+        // leading UMIs
+        int n_cover = 0, n_lead = 0;
+        while (n_cover < n_group) {
+            khiter_t k0 = a[group[n_lead++]].k;
+            if (cover[k0] == 0) cover[k0] = 1, n_cover++;
+            umi_graph_neighbors(&g, k0);
+            for (j = 0; j < g.n_nb; ++j)
+                if (cover[g.nb[j]] == 0) cover[g.nb[j]] = 1, n_cover++;
+        }
+        for (m = 0; m < n_group; ++m) cover[a[group[m]].k] = m < n_lead; // reuse as grouped flag
+        for (m = 0; m < n_lead; ++m) {
+            khiter_t k0 = a[group[m]].k;
+            umi_graph_neighbors(&g, k0);
+            for (j = 0; j < g.n_nb; ++j) {
+                if (cover[g.nb[j]]) continue;
+                cover[g.nb[j]] = 1;
+                umi_correct_to(val, k0, g.nb[j]);
+            }
+        }
+        for (m = 0; m < n_group; ++m) cover[a[group[m]].k] = 0;
+    }
+    free(group);
+    free(cover);
+    free(done);
+    free(rank);
+    free(a);
+    umi_graph_destroy(&g);
+}
+
+void build_index_core(struct bc_corr *bc, struct tag_val *tag_val)
+{
+    if (tag_val->bc != NULL) { //iterate next tag
+        int i;
+        for (i = 0; i < dict_size(tag_val->bc); ++i) {
+            char *name = dict_name(tag_val->bc, i);
+            int id = dict_query(tag_val->bc, name);
+            struct tag_val *v = dict_query_value(tag_val->bc, id);
+            build_index_core(bc, v);
+        }
+        return;
+    }
+
+    kh_bc_t *val = tag_val->val;
+    uint64_t n = kh_size(val);
+    if (n < 2) return;
+
+    if (args.method == UMI_DIRECTIONAL) {
+        umi_cluster_directional(bc, val, n);
+        return;
+    }
+    if (args.method == UMI_ADJACENCY) {
+        umi_cluster_adjacency(bc, val, n);
+        return;
+    }
+    
+    // pairwise comparison is cheaper for small groups
+    uint64_t n_neighbor = bc->umi_len*3;
+    if (args.e_distance == 1 && n*(n-1)/2 > n*n_neighbor)
+        umi_cluster_neighbor(bc, val, n);
+    else
+        umi_cluster_pairwise(bc, val);
+}
 // for one cell, reads with the same umi but map to more than one gene, only keep gene with higher read support.
 // in case of a tie for maximal read support, all reads are discarded.
 void filter_umi_gene(struct bc_corr *bc)
 {
     assert(bc->val->bc); // check if gene exists
-    dict_set_value(bc->umi_val);
+    kh_umi_ptr_t *umis = kh_init(umi_ptr);
     struct dict *gene = bc->val->bc;
     int i;
     for (i = 0; i < dict_size(gene); ++i) {
@@ -259,15 +611,17 @@ void filter_umi_gene(struct bc_corr *bc)
             struct umi_count *cnt = &kh_val(v->val,k);
             if (cnt->primary == 0) continue; // skip if not primary UMI
             
-            struct umi_count *cnt0 = dict_query_value(bc->umi_val, cnt->index);
-            if (cnt0 == NULL) 
-                dict_assign_value(bc->umi_val, cnt->index, cnt);
+            int ret;
+            khint_t k0 = kh_put(umi_ptr, umis, cnt->index, &ret);
+            if (ret) 
+                kh_val(umis, k0) = cnt;
             else { // already present
+                struct umi_count *cnt0 = kh_val(umis, k0);
                 
                 // compare the read count of two group
                 if (cnt0->count < cnt->count) {
                     cnt0->filter = 1;
-                    dict_assign_value(bc->umi_val, cnt->index, cnt); // keep gene UMI with high frequency
+                    kh_val(umis, k0) = cnt; // keep gene UMI with high frequency
                 }
                 else if (cnt0->count == cnt->count) {
                     cnt0->filter = 1; // ambigous
@@ -279,10 +633,11 @@ void filter_umi_gene(struct bc_corr *bc)
             }
         }
     }
+    kh_destroy(umi_ptr, umis);
 }
 void build_index1(struct bc_corr *bc)
 {
-    build_index_core(bc->val, bc->umi_val);
+    build_index_core(bc, bc->val);
     if (args.cr_method)
         filter_umi_gene(bc);
 }
@@ -295,6 +650,7 @@ kh_bc_t *select_umi_hash(struct dict *Cindex, int n, const char **tags)
     if (bc == NULL) {
         bc = malloc(sizeof(struct bc_corr));
         bc->val = malloc(sizeof(struct tag_val));
+        bc->umi_len = -1;
         bc->umi_val = dict_init();
         
         bc->val->val = NULL;
@@ -325,35 +681,38 @@ kh_bc_t *select_umi_hash(struct dict *Cindex, int n, const char **tags)
     if (v->val == NULL) v->val = kh_init(bc);
     return v->val;
 }
-void bc_push(struct dict *bc, int cr_method, int n_tag, const char **tags, const char *umi_tag, bam1_t *b)
+// read only version of select_umi_hash, return NULL if not indexed
+static kh_bc_t *query_umi_hash(struct bc_corr *bc, int n, const char **tags)
 {
-    char **v = sam_tag_values(b, n_tag, tags);
-    if (v == NULL) return;
-    char *umi = (char*)bam_aux_get(b, umi_tag);
-    if (!umi) {
-        free(v);
-        return;
+    struct tag_val *v = bc->val;
+    int i;
+    for (i = 1; i < n; ++i) {
+        if (v->bc == NULL) return NULL;
+        int ret = dict_query(v->bc, tags[i]);
+        if (ret < 0) return NULL;
+        v = dict_query_value(v->bc, ret);
     }
-
-    umi = umi+1; // emit type
-    
+    return v->val;
+}
+static void bc_push_vals(struct dict *bc, int n_tag, char **v, const char *umi)
+{
     kh_bc_t *uhash = select_umi_hash(bc, n_tag, (const char**)v); // select_umi_hash will auto init empty cell
-    char *comp = compactDNA(umi, strlen(umi));
     
     struct bc_corr *bc0 = dict_query_value2(bc, v[0]);
-    free(v);
-    int id = dict_push(bc0->umi_val, comp);
-    free(comp);
-    char *cc = dict_name(bc0->umi_val, id); // use cached string
+    int l = strlen(umi);
+    if (bc0->umi_len == -1) bc0->umi_len = l;
+    if (bc0->umi_len != l) error("Unequal length of UMIs in cell %s, %s.", v[0], umi);
+    uint64_t key;
+    umi_key(bc0, umi, 1, &key);
 
     khiter_t k;    
-    k = kh_get(bc, uhash, cc);
+    k = kh_get(bc, uhash, key);
     if (k == kh_end(uhash)) {
         int ret;
-        k = kh_put(bc, uhash, cc, &ret);
+        k = kh_put(bc, uhash, key, &ret);
         struct umi_count *uc = &kh_val(uhash, k);
         uc->count     = 1;
-        uc->index     = id; // index of umi dict
+        uc->index     = key; // UMI itself before correction
         uc->umi_index = 0;  // init state, do NOT change it
         uc->filter    = 0;  // init state, do NOT change it
         uc->primary   = 1;  // any UMI is primary before check
@@ -363,15 +722,134 @@ void bc_push(struct dict *bc, int cr_method, int n_tag, const char **tags, const
         uc->count++;
     }
 }
+void bc_push(struct dict *bc, int n_tag, const char **tags, const char *umi_tag, bam1_t *b)
+{
+    char *v[n_tag];
+    if (sam_tag_values(b, n_tag, tags, v)) return;
+    char *umi = (char*)bam_aux_get(b, umi_tag);
+    if (!umi) return;
+
+    bc_push_vals(bc, n_tag, v, umi+1); // emit type
+}
+
+// The index is sharded by hash of cell barcode. Records of each chunk are routed to shards by
+// blocks, then each shard is updated by one thread, in order of records.
+struct index_chunk {
+    struct bam_pool *p;
+    int *off;   // offsets of shards in order of each block, n_shard+1 per block
+    int *order; // records of each block, grouped by shard
+};
+
+#define ROUTE_BLOCK 1024
+
+static int pass_filter(bam1_t *b)
+{
+    bam1_core_t *c = &b->core;
+    if (c->flag & BAM_FQCFAIL ||
+        c->flag & BAM_FSECONDARY ||
+        c->flag & BAM_FSUPPLEMENTARY ||
+        c->flag & BAM_FUNMAP ||
+        c->flag & BAM_FDUP) return 0;
+    return 1;
+}
+
+static int cell_shard(const char *cell)
+{
+    return kh_str_hash_func(cell) % args.n_shard;
+}
+
+static struct dict *cell_index(const char *cell)
+{
+    return args.Cindex[cell_shard(cell)];
+}
+
+static void route_worker(void *_d, long i, int tid)
+{
+    struct index_chunk *d = (struct index_chunk*)_d;
+    int n = args.n_shard;
+    int b0 = i*ROUTE_BLOCK;
+    int e = b0 + ROUTE_BLOCK < d->p->n ? b0 + ROUTE_BLOCK : d->p->n;
+    int *off = d->off + i*(n+1);
+    int shard[ROUTE_BLOCK];
+    int j;
+
+    memset(off, 0, (n+1)*sizeof(int));
+    for (j = b0; j < e; ++j) {
+        bam1_t *b = &d->p->bam[j];
+        shard[j-b0] = -1;
+        if (!pass_filter(b)) continue;
+        uint8_t *cell = bam_aux_get(b, args.blocks[0]);
+        if (!cell) continue;
+        shard[j-b0] = cell_shard((char*)(cell+1));
+        off[shard[j-b0]+1]++;
+    }
+    for (j = 0; j < n; ++j) off[j+1] += off[j];
+
+    int cur[n];
+    memcpy(cur, off, n*sizeof(int));
+    for (j = b0; j < e; ++j)
+        if (shard[j-b0] != -1) d->order[b0 + cur[shard[j-b0]]++] = j;
+}
 
-struct dict *build_index(const char *fn, int cr_method, int n_tag, const char **tags, const char *umi_tag)
+static void shard_worker(void *_d, long i, int tid)
+{
+    struct index_chunk *d = (struct index_chunk*)_d;
+    int n = args.n_shard;
+    int n_block = (d->p->n + ROUTE_BLOCK - 1)/ROUTE_BLOCK;
+    int k, j;
+    for (k = 0; k < n_block; ++k) {
+        int *off = d->off + k*(n+1);
+        int *order = d->order + k*ROUTE_BLOCK;
+        for (j = off[i]; j < off[i+1]; ++j)
+            bc_push(args.Cindex[i], args.n_block, (const char**)args.blocks, args.tag, &d->p->bam[order[j]]);
+    }
+}
+
+static void *index_pipeline(void *shared, int step, void *_d)
+{
+    htsFile *fp = ((void**)shared)[0];
+    bam_hdr_t *hdr = ((void**)shared)[1];
+    if (step == 0) {
+        struct bam_pool *p = bam_pool_create();
+        bam_read_pool(p, fp, hdr, args.chunk_size);
+        if (p->n == 0) {
+            bam_pool_destory(p);
+            return NULL;
+        }
+        return p;
+    }
+    struct index_chunk d;
+    d.p = (struct bam_pool*)_d;
+    int n_block = (d.p->n + ROUTE_BLOCK - 1)/ROUTE_BLOCK;
+    d.off = malloc(n_block*(args.n_shard+1)*sizeof(int));
+    d.order = malloc(d.p->n*sizeof(int));
+    kt_for(args.n_thread, route_worker, &d, n_block);
+    kt_for(args.n_thread, shard_worker, &d, args.n_shard);
+    free(d.off);
+    free(d.order);
+    bam_pool_destory(d.p);
+    return NULL;
+}
+
+static void cluster_worker(void *_d, long i, int tid)
+{
+    struct bc_corr **bcs = (struct bc_corr**)_d;
+    build_index1(bcs[i]);
+}
+
+void build_index(const char *fn)
 {
     LOG_print("Building index ..");
     double t_real;
     t_real = realtime();
 
-    struct dict *cell_bc = dict_init();
-    dict_set_value(cell_bc);
+    int i, j;
+    args.n_shard = args.n_thread;
+    args.Cindex = malloc(args.n_shard*sizeof(struct dict*));
+    for (i = 0; i < args.n_shard; ++i) {
+        args.Cindex[i] = dict_init();
+        dict_set_value(args.Cindex[i]);
+    }
     
     htsFile *fp = hts_open(fn, "r");
     
@@ -380,33 +858,27 @@ struct dict *build_index(const char *fn, int cr_method, int n_tag, const char **
     if (type.format != bam && type.format != sam) error("Unsupported input format, only support BAM/SAM/CRAM format.");
     
     bam_hdr_t *hdr = sam_hdr_read(fp);
+    CHECK_EMPTY(hdr, "Failed to open header.");
     hts_set_threads(fp, args.file_th);
-    bam1_t *b = bam_init1();
-    int i;
-    for (;;) {
-        if (sam_read1(fp, hdr, b) < 0) break;
-        bam1_core_t *c = &b->core;
-        if (c->flag & BAM_FQCFAIL ||
-            c->flag & BAM_FSECONDARY ||
-            c->flag & BAM_FSUPPLEMENTARY ||
-            c->flag & BAM_FUNMAP ||
-            c->flag & BAM_FDUP) continue;
-        bc_push(cell_bc, cr_method, n_tag, tags, umi_tag, b);
-    }
-    bam_destroy1(b);
+
+    void *shared[2] = { fp, hdr };
+    kt_pipeline(2, index_pipeline, shared, 2);
+    
     bam_hdr_destroy(hdr);
     sam_close(fp);
 
-    //struct tpool *tp = tpool_init(args.n_thread, args.n_thread*2, 1);
-
-    for (i = 0; i < dict_size(cell_bc); ++i) {
-        struct bc_corr *bc0 = dict_query_value(cell_bc, i);
-        build_index1(bc0);
-        //tpool_add_work(tp, build_index1, bc0);
-    }
-    //tpool_destroy(tp);
+    // UMIs of each cell are clustered in parallel
+    int n = 0;
+    for (i = 0; i < args.n_shard; ++i) n += dict_size(args.Cindex[i]);
+    struct bc_corr **bcs = malloc(n*sizeof(void*));
+    n = 0;
+    for (i = 0; i < args.n_shard; ++i)
+        for (j = 0; j < dict_size(args.Cindex[i]); ++j)
+            bcs[n++] = dict_query_value(args.Cindex[i], j);
+    kt_for(args.n_thread, cluster_worker, bcs, n);
+    free(bcs);
+    
     LOG_print("Build time : %.3f sec", realtime() - t_real);
-    return cell_bc;
 }
 
 static int parse_args(int argc, char **argv)
@@ -417,6 +889,8 @@ static int parse_args(int argc, char **argv)
     const char *file_th = NULL;
     const char *thread = NULL;
     const char *distance = NULL;
+    const char *method = NULL;
+    const char *mem = NULL;
     
     int i;
     for (i = 1; i < argc;) {
@@ -431,10 +905,17 @@ static int parse_args(int argc, char **argv)
         else if (strcmp(a, "-t") == 0) var = &thread;
         else if (strcmp(a, "-new-tag") == 0) var = &args.new_tag;
         else if (strcmp(a, "-e") == 0) var = &distance;
+        else if (strcmp(a, "-method") == 0) var = &method;
+        else if (strcmp(a, "-m") == 0) var = &mem;
+        else if (strcmp(a, "-prefix") == 0) var = &args.prefix;
         else if (strcmp(a, "-cr") == 0) {
             args.cr_method = 1;
             continue;
         }
+        else if (strcmp(a, "-cell-sorted") == 0) {
+            args.cell_sorted = 1;
+            continue;
+        }
 
         if (var != 0) {
             if (i == argc) error("Miss an argument after %s.", a);
@@ -470,52 +951,75 @@ static int parse_args(int argc, char **argv)
     if (thread) args.n_thread = str2int((char*)thread);
     if (distance) args.e_distance = str2int((char*)distance);
     if (args.e_distance < 1) error("Hamming distance of similar barcodes greater than 0 is required.");
+    if (method) {
+        if (strcmp(method, "cluster") == 0) args.method = UMI_CLUSTER;
+        else if (strcmp(method, "adjacency") == 0) args.method = UMI_ADJACENCY;
+        else if (strcmp(method, "directional") == 0) args.method = UMI_DIRECTIONAL;
+        else error("Unknown method, %s. Only support cluster, adjacency and directional.", method);
+    }
+    
+    if (args.n_thread < 1) args.n_thread = 1;
+
+    if (mem) {
+        args.mem = human2int64(mem);
+        if (args.mem <= 0) error("Bad memory size, %s.", mem);
+        if (args.cell_sorted) error("-m is not supported with -cell-sorted.");
+        if (args.prefix == NULL) args.prefix = args.output_fname;
+    }
     
-    args.Cindex = build_index(args.input_fname, args.cr_method, args.n_block, (const char **)args.blocks, args.tag);
+    // cells are indexed and corrected one by one while reading
+    if (args.cell_sorted) return 0;
 
-    if (args.Cindex == NULL) error("Failed to index.");
+    // index is built by buckets later
+    if (args.mem) return 0;
+    
+    build_index(args.input_fname);
     
     return 0;
 }
-char *select_umi(struct dict *Cindex, int n,const char **tags, char *umi)
+// Index is only read here, records not indexed (filtered by flag) are corrected if same UMI
+// found in the group, or kept unchanged. Corrected UMI is decoded to str, no allocation per read.
+char *select_umi(struct dict *Cindex, int n,const char **tags, char *umi, kstring_t *str)
 {
-    int l = strlen(umi);
-    char *cu = compactDNA(umi, l);
-    assert(cu);
-    kh_bc_t *v = select_umi_hash(Cindex, n, tags);
+    int cell_idx = dict_query(Cindex, tags[0]);
+    if (cell_idx < 0) return NULL;
+    struct bc_corr *bc = dict_query_value(Cindex, cell_idx);
+    kh_bc_t *v = query_umi_hash(bc, n, tags);
+    if (v == NULL) return NULL;
+    uint64_t key;
+    if (umi_key(bc, umi, 0, &key)) return NULL;
     khiter_t k;
-    k = kh_get(bc, v, cu);
-    assert(k != kh_end(v));
-    free(cu);
+    k = kh_get(bc, v, key);
+    if (k == kh_end(v)) return NULL;
     struct umi_count *cnt = &kh_val(v,k);
     if (cnt->filter) return NULL;
     
-    int cell_idx = dict_query(Cindex, tags[0]);
-    struct bc_corr *bc = dict_query_value(Cindex, cell_idx);
-    const char *r = dict_name(bc->umi_val, cnt->index);
-    return compDNA_decode(r);
+    return umi_decode(bc, cnt->index, str);
+}
+static void write_new_umi(bam1_t *b, char *umi, const char *new_umi, int l)
+{
+    if (args.new_tag)
+        bam_aux_append(b, args.new_tag, 'Z', l+1, (uint8_t*)new_umi);
+    else
+        memcpy(umi+1, new_umi, l); // since it is equal length, just reset the memory..
 }
-int update_new_tag(struct dict *Cindex, int n_block, const char **blocks, const char *old_tag, const char *new_tag, bam1_t *b)
+
+// Cindex is the index of this cell for -cell-sorted, or NULL to look up the sharded index
+int update_new_tag(struct dict *Cindex, int n_block, const char **blocks, const char *old_tag, bam1_t *b, kstring_t *str)
 {
     char *umi = (char *)bam_aux_get(b, old_tag);
     if (!umi) return 0;
     // assert(umi);
     
-    char **tag_vals = sam_tag_values(b, n_block, blocks);
-    if (tag_vals == NULL) return 0;
+    char *tag_vals[n_block];
+    if (sam_tag_values(b, n_block, blocks, tag_vals)) return 0;
     
-    char *new_umi = select_umi(Cindex, n_block, (const char **)tag_vals, umi+1);
-   
-    free(tag_vals);
+    if (Cindex == NULL) Cindex = cell_index(tag_vals[0]);
+    char *new_umi = select_umi(Cindex, n_block, (const char **)tag_vals, umi+1, str);
     
     if (!new_umi) return 0;
     
-    if (new_tag)
-        bam_aux_append(b, args.new_tag, 'Z', strlen(new_umi)+1, (uint8_t*)new_umi);
-    else
-        memcpy(umi, new_umi, strlen(new_umi)); // since it is equal length, just reset the memory..
-    
-    free(new_umi);
+    write_new_umi(b, umi, new_umi, str->l);
     return 1;
 }
 
@@ -524,10 +1028,12 @@ static void *run_it(void *data)
     struct bam_pool *p = (struct bam_pool*)data;
     int i;
     int c = 0;
+    kstring_t str = {0,0,0};
     for (i = 0; i < p->n; ++i) {
         bam1_t *b = &p->bam[i];
-        c += update_new_tag(args.Cindex, args.n_block, (const char**)args.blocks, args.tag, args.new_tag, b);
+        c += update_new_tag(NULL, args.n_block, (const char**)args.blocks, args.tag, b, &str);
     }
+    free(str.s);
     
     return p;
 }
@@ -539,6 +1045,341 @@ static void write_out(struct bam_pool *p)
     bam_pool_destory(p);
 }
 
+// -cell-sorted, records of complete cells are read into one chunk. Each cell is indexed,
+// clustered and corrected on its own, so the input is only read once and memory is bounded
+// by chunk size and the largest cell.
+struct cell_chunk {
+    struct bam_pool *p;
+    int n_cell, m_cell;
+    int *start; // first record of each cell
+};
+
+static struct cell_chunk *read_cell_chunk()
+{
+    struct bam_pool *p = bam_pool_create();
+    struct cell_chunk *c = calloc(1, sizeof(*c));
+    c->p = p;
+    
+    kstring_t cell = {0,0,0};
+    int ret = 0;
+    for (;;) {
+        if (p->n == p->m) {
+            p->m = p->m == 0 ? 1024 : p->m*2;
+            p->bam = realloc(p->bam, p->m*sizeof(bam1_t));
+            memset(p->bam + p->n, 0, (p->m - p->n)*sizeof(bam1_t));
+        }
+        bam1_t *b = &p->bam[p->n];
+        if (args.has_next) {
+            *b = args.next;
+            args.has_next = 0;
+        }
+        else if ((ret = sam_read1(args.in, args.hdr, b)) < 0) break;
+        
+        uint8_t *tag = bam_aux_get(b, args.blocks[0]);
+        // records without cell barcode are kept with the current cell, nothing to correct
+        if (tag && (c->n_cell == 0 || strcmp(cell.s, (char*)(tag+1)) != 0)) {
+            // keep this record for next chunk
+            if (p->n >= args.chunk_size) {
+                args.next = *b;
+                args.has_next = 1;
+                memset(b, 0, sizeof(bam1_t));
+                break;
+            }
+            if (dict_query(args.done_cells, (char*)(tag+1)) != -1)
+                error("Records are not grouped by cell barcode, %s appears again.", (char*)(tag+1));
+            dict_push(args.done_cells, (char*)(tag+1));
+            
+            if (c->n_cell == c->m_cell) {
+                c->m_cell = c->m_cell == 0 ? 1024 : c->m_cell*2;
+                c->start = realloc(c->start, (c->m_cell+1)*sizeof(int));
+            }
+            c->start[c->n_cell++] = p->n;
+            cell.l = 0;
+            kputs((char*)(tag+1), &cell);
+        }
+        p->n++;
+    }
+    if (ret < -1) warnings("Truncated file?");
+    free(cell.s);
+    
+    if (p->n == 0) {
+        bam_pool_destory(p);
+        free(c->start);
+        free(c);
+        return NULL;
+    }
+    if (c->n_cell == 0) c->start = malloc(sizeof(int));
+    c->start[c->n_cell] = p->n;
+    return c;
+}
+
+static void cell_worker(void *_d, long i, int tid)
+{
+    struct cell_chunk *c = (struct cell_chunk*)_d;
+    struct bam_pool *p = c->p;
+    int j;
+    struct dict *Cindex = dict_init();
+    dict_set_value(Cindex);
+    for (j = c->start[i]; j < c->start[i+1]; ++j)
+        if (pass_filter(&p->bam[j])) bc_push(Cindex, args.n_block, (const char**)args.blocks, args.tag, &p->bam[j]);
+
+    for (j = 0; j < dict_size(Cindex); ++j) build_index1(dict_query_value(Cindex, j));
+    
+    kstring_t str = {0,0,0};
+    for (j = c->start[i]; j < c->start[i+1]; ++j)
+        update_new_tag(Cindex, args.n_block, (const char**)args.blocks, args.tag, &p->bam[j], &str);
+    free(str.s);
+    bc_corr_destroy(Cindex);
+}
+
+static void *cell_pipeline(void *shared, int step, void *_d)
+{
+    if (step == 0) return read_cell_chunk();
+    
+    struct cell_chunk *c = (struct cell_chunk*)_d;
+    if (step == 1) {
+        // records before the first cell barcode have nothing to correct
+        if (c->n_cell) kt_for(args.n_thread, cell_worker, c, c->n_cell);
+        return c;
+    }
+    write_out(c->p);
+    free(c->start);
+    free(c);
+    return NULL;
+}
+
+// -m, the index is split into buckets on disk by hash of cell barcode. Buckets are indexed and
+// corrected in batches under the memory cap, corrected UMIs are written back to disk in the order
+// of records, and applied to records in a final pass.
+#define SPILL_BUCKETS 256
+
+// Estimated index memory of a bucket. Besides records, each cell and each distinct tag value under
+// it allocates its own structures, which dominate for shallow barcodes. A tag dict reserves 1024
+// slots at first push.
+#define SPILL_REC_MEM  64    // per record
+#define SPILL_CELL_MEM 256   // struct bc_corr, struct tag_val and UMI dict of a cell
+#define SPILL_NODE_MEM 128   // struct tag_val and name of a tag value under cell
+#define SPILL_DICT_MEM 20608 // dict of tag values under a cell or tag value
+#define SPILL_HASH_MEM 256   // UMI hash of a cell x gene group
+
+struct spill {
+    char    *fn[SPILL_BUCKETS];  // block tags and UMI of records
+    char    *res[SPILL_BUCKETS]; // corrected UMIs
+    uint64_t n[SPILL_BUCKETS];
+    uint64_t mem[SPILL_BUCKETS]; // estimated index memory
+};
+
+// hash of block tag prefix, v[0..i] are hashed one by one
+static inline uint64_t spill_prefix_hash(uint64_t h, const char *s)
+{
+    for (; *s; ++s) h = (h ^ (uint8_t)*s) * 0x100000001b3ULL;
+    return (h ^ '\t') * 0x100000001b3ULL;
+}
+
+// charge structures of new cells and tag values of a record to its bucket
+static void spill_count(struct spill *sp, kh_pfx_t *seen, int bucket, char **v)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    int i, ret;
+    for (i = 0; i < args.n_block; ++i) {
+        h = spill_prefix_hash(h, v[i]);
+        kh_put(pfx, seen, h, &ret);
+        if (ret == 0) continue; // seen
+        sp->mem[bucket] += i == 0 ? SPILL_CELL_MEM : SPILL_NODE_MEM;
+        sp->mem[bucket] += i < args.n_block-1 ? SPILL_DICT_MEM : SPILL_HASH_MEM;
+    }
+}
+
+static char *spill_fname(int i, const char *suffix)
+{
+    char *name = calloc(strlen(args.prefix)+30, 1);
+    sprintf(name, "%s.%.4d.%s.bgz", args.prefix, i, suffix);
+    return name;
+}
+
+// return bucket of record, or -1 if UMI or any block tag not set
+static int spill_bucket(bam1_t *b, char **v, char **umi)
+{
+    *umi = (char*)bam_aux_get(b, args.tag);
+    if (!*umi) return -1;
+    if (sam_tag_values(b, args.n_block, (const char**)args.blocks, v)) return -1;
+    return kh_str_hash_func(v[0]) % SPILL_BUCKETS;
+}
+
+static void spill_split(struct spill *sp)
+{
+    htsFile *fp = hts_open(args.input_fname, "r");
+    CHECK_EMPTY(fp, "%s : %s.", args.input_fname, strerror(errno));
+    bam_hdr_t *hdr = sam_hdr_read(fp);
+    CHECK_EMPTY(hdr, "Failed to open header.");
+    hts_set_threads(fp, args.file_th);
+
+    BGZF *out[SPILL_BUCKETS];
+    int i;
+    for (i = 0; i < SPILL_BUCKETS; ++i) {
+        sp->fn[i] = spill_fname(i, "umi");
+        sp->res[i] = spill_fname(i, "corr");
+        sp->n[i] = 0;
+        sp->mem[i] = 0;
+        out[i] = bgzf_open(sp->fn[i], "w1");
+        CHECK_EMPTY(out[i], "%s : %s.", sp->fn[i], strerror(errno));
+    }
+    
+    bam1_t *b = bam_init1();
+    char *v[args.n_block];
+    char *umi;
+    kstring_t str = {0,0,0};
+    kh_pfx_t *seen = kh_init(pfx);
+    while (sam_read1(fp, hdr, b) >= 0) {
+        int bucket = spill_bucket(b, v, &umi);
+        if (bucket == -1) continue;
+        str.l = 0;
+        int pass = pass_filter(b);
+        if (pass) spill_count(sp, seen, bucket, v);
+        kputc(pass ? '1' : '0', &str);
+        for (i = 0; i < args.n_block; ++i) {
+            kputc('\t', &str);
+            kputs(v[i], &str);
+        }
+        kputc('\t', &str);
+        kputs(umi+1, &str);
+        kputc('\n', &str);
+        if (bgzf_write(out[bucket], str.s, str.l) != str.l) error("Failed to write %s.", sp->fn[bucket]);
+        sp->n[bucket]++;
+        sp->mem[bucket] += SPILL_REC_MEM;
+    }
+    kh_destroy(pfx, seen);
+    free(str.s);
+    bam_destroy1(b);
+    for (i = 0; i < SPILL_BUCKETS; ++i) bgzf_close(out[i]);
+    bam_hdr_destroy(hdr);
+    sam_close(fp);
+}
+
+// split line of bucket file, return 1 if record pass the filter
+static int spill_parse(kstring_t *str, char **v, char **umi)
+{
+    char *p = str->s;
+    int i;
+    for (i = 0; i <= args.n_block; ++i) {
+        p = strchr(p, '\t');
+        if (p == NULL) error("Truncated temp file.");
+        *p++ = '\0';
+        if (i < args.n_block) v[i] = p;
+        else *umi = p;
+    }
+    return str->s[0] == '1';
+}
+
+static void spill_batch(struct spill *sp, int start, int end)
+{
+    struct dict *C = dict_init();
+    dict_set_value(C);
+    
+    char *v[args.n_block+1]; // with UMI in the last
+    char *umi;
+    kstring_t str = {0,0,0};
+    int i;
+    for (i = start; i < end; ++i) {
+        BGZF *fp = bgzf_open(sp->fn[i], "r");
+        CHECK_EMPTY(fp, "%s : %s.", sp->fn[i], strerror(errno));
+        while (bgzf_getline(fp, '\n', &str) >= 0) {
+            if (spill_parse(&str, v, &umi)) bc_push_vals(C, args.n_block, v, umi);
+        }
+        bgzf_close(fp);
+    }
+
+    int n = dict_size(C);
+    struct bc_corr **bcs = malloc(n*sizeof(void*));
+    for (i = 0; i < n; ++i) bcs[i] = dict_query_value(C, i);
+    kt_for(args.n_thread, cluster_worker, bcs, n);
+    free(bcs);
+
+    kstring_t new_umi = {0,0,0};
+    for (i = start; i < end; ++i) {
+        BGZF *fp = bgzf_open(sp->fn[i], "r");
+        CHECK_EMPTY(fp, "%s : %s.", sp->fn[i], strerror(errno));
+        BGZF *out = bgzf_open(sp->res[i], "w1");
+        CHECK_EMPTY(out, "%s : %s.", sp->res[i], strerror(errno));
+        while (bgzf_getline(fp, '\n', &str) >= 0) {
+            spill_parse(&str, v, &umi);
+            if (select_umi(C, args.n_block, (const char**)v, umi, &new_umi) == NULL) kputs("*", &new_umi);
+            kputc('\n', &new_umi);
+            if (bgzf_write(out, new_umi.s, new_umi.l) != new_umi.l) error("Failed to write %s.", sp->res[i]);
+            new_umi.l = 0;
+        }
+        bgzf_close(fp);
+        bgzf_close(out);
+        unlink(sp->fn[i]);
+    }
+    free(new_umi.s);
+    free(str.s);
+    bc_corr_destroy(C);
+}
+
+static void spill_apply(struct spill *sp)
+{
+    BGZF *fp[SPILL_BUCKETS];
+    int i;
+    for (i = 0; i < SPILL_BUCKETS; ++i) {
+        fp[i] = bgzf_open(sp->res[i], "r");
+        CHECK_EMPTY(fp[i], "%s : %s.", sp->res[i], strerror(errno));
+    }
+    hts_set_threads(args.in, args.file_th);
+    
+    bam1_t *b = bam_init1();
+    char *v[args.n_block];
+    char *umi;
+    kstring_t str = {0,0,0};
+    while (sam_read1(args.in, args.hdr, b) >= 0) {
+        int bucket = spill_bucket(b, v, &umi);
+        if (bucket != -1) {
+            if (bgzf_getline(fp[bucket], '\n', &str) < 0) error("Truncated temp file.");
+            if (str.s[0] != '*') write_new_umi(b, umi, str.s, str.l);
+        }
+        if (sam_write1(args.out, args.hdr, b) == -1) error("Failed to write SAM.");
+    }
+    free(str.s);
+    bam_destroy1(b);
+    
+    for (i = 0; i < SPILL_BUCKETS; ++i) {
+        bgzf_close(fp[i]);
+        unlink(sp->res[i]);
+        free(sp->fn[i]);
+        free(sp->res[i]);
+    }
+}
+
+static void spill_run()
+{
+    struct spill sp;
+    double t_real;
+    t_real = realtime();
+    
+    LOG_print("Splitting records into %d buckets ..", SPILL_BUCKETS);
+    spill_split(&sp);
+
+    // each batch of buckets are indexed under memory cap
+    int i = 0;
+    while (i < SPILL_BUCKETS) {
+        int j = i;
+        uint64_t mem = 0;
+        do {
+            mem += sp.mem[j];
+            j++;
+        }
+        while (j < SPILL_BUCKETS && mem + sp.mem[j] <= args.mem);
+        if (mem > args.mem)
+            warnings("Bucket %d needs about %"PRIu64" MB, over the memory cap. Build it anyway.", i, mem>>20);
+        LOG_print("Correcting buckets %d-%d ..", i, j-1);
+        spill_batch(&sp, i, j);
+        i = j;
+    }
+    LOG_print("Build time : %.3f sec", realtime() - t_real);
+    
+    spill_apply(&sp);
+}
+
 extern int bam_corr_usage();
 
 int bam_corr_umi(int argc, char **argv)
@@ -559,6 +1400,22 @@ int bam_corr_umi(int argc, char **argv)
     
     hts_set_threads(args.out, args.file_th); // write file in multi-threads
 
+    if (args.cell_sorted) {
+        hts_set_threads(args.in, args.file_th);
+        args.done_cells = dict_init();
+        kt_pipeline(3, cell_pipeline, NULL, 3);
+        memory_release();
+        LOG_print("Real time: %.3f sec; CPU: %.3f sec", realtime() - t_real, cputime());
+        return 0;
+    }
+
+    if (args.mem) {
+        spill_run();
+        memory_release();
+        LOG_print("Real time: %.3f sec; CPU: %.3f sec", realtime() - t_real, cputime());
+        return 0;
+    }
+    
     hts_tpool *p = hts_tpool_init(args.n_thread);
     hts_tpool_process *q = hts_tpool_process_init(p, args.n_thread*2, 0);
     hts_tpool_result *r;
@@ -108,8 +108,7 @@ char *compDNA_decode(const char *a)
     assert(a);
     int l;
     l = strlen(a);
-    int l1 = l*2 + (a[l-1]&0xf);
-    char *r = malloc(l1);
+    char *r = malloc(l*2+1);
     int i;
     int j = 0;
     for (i = 0; i < l; ++i) {
@@ -43,6 +43,12 @@ void gtf_clear(struct gtf *gtf)
     }
     if (gtf->n_gtf) free(gtf->gtf);
 
+    if (gtf->n_exon) {
+        free(gtf->exon_start);
+        free(gtf->exon_end);
+        free(gtf->exon_maxend);
+    }
+
     if (gtf->attr != NULL) {
         int i;
         for (i = 0; i < dict_size(gtf->attr); ++i) {
@@ -393,6 +399,29 @@ static int parse_str(struct gtf_spec *G, kstring_t *str, int filter)
     gtf_clear(&gtf);
     return 0;
 }
+// copy exon coordinates of a sorted transcript into plain arrays
+static void gtf_build_exon_index(struct gtf *gtf)
+{
+    int i;
+    for (i = 0; i < gtf->n_gtf; ++i)
+        if (gtf->gtf[i]->type == feature_exon) gtf->n_exon++;
+
+    if (gtf->n_exon == 0) return;
+    
+    gtf->exon_start  = malloc(gtf->n_exon*sizeof(int));
+    gtf->exon_end    = malloc(gtf->n_exon*sizeof(int));
+    gtf->exon_maxend = malloc(gtf->n_exon*sizeof(int));
+
+    int j = 0;
+    for (i = 0; i < gtf->n_gtf; ++i) {
+        struct gtf *g0 = gtf->gtf[i];
+        if (g0->type != feature_exon) continue;
+        gtf->exon_start[j] = g0->start;
+        gtf->exon_end[j] = g0->end;
+        gtf->exon_maxend[j] = j == 0 || gtf->exon_maxend[j-1] < g0->end ? g0->end : gtf->exon_maxend[j-1];
+        j++;
+    }
+}
 static void gtf_sort(struct gtf *gtf)
 {
     int i;
@@ -409,6 +438,8 @@ static void gtf_sort(struct gtf *gtf)
         }
         assert(gtf->start < gtf->end);
     }
+
+    if (gtf->type == feature_transcript) gtf_build_exon_index(gtf);
     /*
     if (gtf->query) {
         dict_destroy(gtf->query); // destroy query dict
@@ -62,6 +62,12 @@ struct gtf {
     //struct dict *query; // used to fast access gtf, dedup
     int n_gtf, m_gtf;
     struct gtf **gtf;
+
+    // exons of transcript, sorted by coordinate, built with index
+    int n_exon;
+    int *exon_start;
+    int *exon_end;
+    int *exon_maxend; // maximal end of exons before and include this one, for binary search
 };
 
 struct _ctg_idx;
@@ -331,3 +331,13 @@ int human2int(const char *str)
     else if (*q == 'g'||*q=='G') m<<=30;
     return m;
 }
+int64_t human2int64(const char *str)
+{
+    char *q;
+    int64_t m = strtoll(str, &q, 0);
+    if (*q == 'k'||*q=='K') m<<=10;
+    else if (*q == 'm'||*q=='M') m<<=20;
+    else if (*q == 'g'||*q=='G') m<<=30;
+    else if (*q == 't'||*q=='T') m<<=40;
+    return m;
+}
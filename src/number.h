@@ -26,6 +26,7 @@
 #define NUMBER_HEADER
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 
 extern int get_numbase(const char *s);
 extern int get_numbase_l(const char *s, int l);
@@ -39,4 +40,5 @@ extern double force2num_l(char *str, int l);
 extern int str2int(const char *str);
 extern int str2int_l(const char *str, int l);
 extern int human2int(const char *str);
+extern int64_t human2int64(const char *str);
 #endif
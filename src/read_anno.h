@@ -18,6 +18,9 @@ static char *exon_type_names[] = {
 };
 
 
+// header line of integer feature ID, written by anno -ftag, @CO	FI:<tag>:<id>	<name>
+#define FEATURE_ID_HDR "FI"
+
 static char *RE_tags[] = {
     "U", "E", "N", "C", "A", "S", "V", "I",
 };
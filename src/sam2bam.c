@@ -343,8 +343,10 @@ static void sam_stat_reads(bam1_t *b, struct summary *s, int *flag, struct args
         }
     }    
 }
-extern struct gtf_anno_type *bam_gtf_anno_core(bam1_t *b, struct gtf_spec const *G, bam_hdr_t *h);
-extern void gtf_anno_destroy(struct gtf_anno_type *ann);
+struct anno_buf;
+extern struct anno_buf *anno_buf_init();
+extern void anno_buf_destroy(struct anno_buf *buf);
+extern struct gtf_anno_type *bam_gtf_anno_core(bam1_t *b, struct gtf_spec const *G, bam_hdr_t *h, struct anno_buf *buf);
 extern int sam_realloc_bam_data(bam1_t *b, size_t desired);
 // return 0 on not correct, 1 on corrected
 static void shrink_bam(bam1_t *bam)
@@ -363,7 +365,7 @@ static void shrink_bam(bam1_t *bam)
         }
     }
 }
-int bam_map_qual_corr(bam1_t **b, int n, struct gtf_spec const *G, int qual)
+int bam_map_qual_corr(bam1_t **b, int n, struct gtf_spec const *G, int qual, struct anno_buf *buf)
 {
     int i;
     int best_hits = 0;
@@ -380,20 +382,17 @@ int bam_map_qual_corr(bam1_t **b, int n, struct gtf_spec const *G, int qual)
             memcpy(data, bam->data + (c->n_cigar<<2) + c->l_qname, l_data);
             l_qseq = c->l_qseq;
         }
-        struct gtf_anno_type *ann = bam_gtf_anno_core(bam, G, args.hdr);
+        struct gtf_anno_type *ann = bam_gtf_anno_core(bam, G, args.hdr, buf);
         if (ann == NULL) continue;
         // read mapped in exon will be selected
         if (ann->type != type_exon &&
             ann->type != type_splice &&
             ann->type != type_exon_intron) {
-            gtf_anno_destroy(ann);
-
             continue;
         }
             
         if (c->flag & BAM_FSECONDARY) best_bam = i;
         best_hits++;
-        gtf_anno_destroy(ann);
     }
     // only one secondary alignment hit exonic region
     if (best_hits > 1) {
@@ -448,6 +447,7 @@ int bam_pool_qual_corr(struct sam_pool *p)
 {
     int i;
     int corred = 0;
+    struct anno_buf *buf = anno_buf_init();
     for (i = 0; i < p->n; ) {
         bam1_t *bam = p->bam[i];
         if (bam == NULL) {
@@ -483,9 +483,10 @@ int bam_pool_qual_corr(struct sam_pool *p)
         
         int j;
         for (j = 0; j < ed-st+1; ++j) b[j] = p->bam[st+j];
-        corred += bam_map_qual_corr(b, n, args.G, args.qual_corr);
+        corred += bam_map_qual_corr(b, n, args.G, args.qual_corr, buf);
         free(b); // free stack
     }
+    anno_buf_destroy(buf);
     return corred;
 }
 static int sam_safe_check(kstring_t *str)
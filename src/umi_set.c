@@ -0,0 +1,226 @@
+#include "umi_set.h"
+#include "htslib/khash.h"
+
+KHASH_MAP_INIT_STR(umi, uint8_t)
+
+static const unsigned char nt4_table[256] = {
+    4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,
+    4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,
+    4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,
+    4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,
+    4, 0, 4, 1,  4, 4, 4, 2,  4, 4, 4, 4,  4, 4, 4, 4,
+    4, 4, 4, 4,  3, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,
+    4, 0, 4, 1,  4, 4, 4, 2,  4, 4, 4, 4,  4, 4, 4, 4,
+    4, 4, 4, 4,  3, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,
+
+    4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,
+    4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,
+    4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,
+    4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,
+    4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,
+    4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,
+    4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,
+    4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4
+};
+
+int umi_pack(const char *seq, int l, uint64_t *key)
+{
+    if (l > 32) return -1;
+    uint64_t x = 0;
+    int i;
+    for (i = 0; i < l; ++i) {
+        int c = nt4_table[(unsigned char)seq[i]];
+        if (c > 3) return -1;
+        x = x<<2 | c;
+    }
+    *key = x;
+    return 0;
+}
+
+void umi_set_init(struct umi_set *s)
+{
+    memset(s, 0, sizeof(*s));
+}
+
+void umi_set_clear(struct umi_set *s)
+{
+    if (s->m) {
+        free(s->h);
+        if (s->hs) free(s->hs);
+    }
+    if (s->str) {
+        kh_umi_t *h = (kh_umi_t*)s->str;
+        khint_t k;
+        for (k = kh_begin(h); k != kh_end(h); ++k)
+            if (kh_exist(h, k)) free((char*)kh_key(h, k));
+        kh_destroy(umi, h);
+    }
+    memset(s, 0, sizeof(*s));
+}
+
+static inline uint32_t umi_hash(uint64_t key, uint32_t m)
+{
+    // fibonacci hashing, m is power of 2
+    return (uint32_t)((key * 0x9E3779B97F4A7C15ULL) >> 32) & (m - 1);
+}
+
+static uint32_t umi_hash_insert(uint64_t *h, uint32_t m, uint64_t key)
+{
+    uint32_t i = umi_hash(key, m);
+    while (h[i] != 0) i = (i + 1) & (m - 1);
+    h[i] = key;
+    return i;
+}
+
+static void umi_set_resize(struct umi_set *s, uint32_t m)
+{
+    uint64_t *h = calloc(m, sizeof(uint64_t));
+    uint8_t *hs = NULL;
+    uint32_t i, j;
+    if (s->m == 0) {
+        uint64_t a[UMI_SET_INLINE];
+        memcpy(a, s->a, sizeof(a)); // a is shared with hash table
+        for (i = 0; i < s->n; ++i) 
+            if (s->state[i]) break;
+        if (i < s->n) hs = calloc(m, 1);
+        for (i = 0; i < s->n; ++i) {
+            if (a[i] == 0) {
+                s->zero = 1;
+                s->zero_state = s->state[i];
+                continue;
+            }
+            j = umi_hash_insert(h, m, a[i]);
+            if (hs) hs[j] = s->state[i];
+        }
+    }
+    else {
+        if (s->hs) hs = calloc(m, 1);
+        for (i = 0; i < s->m; ++i) {
+            if (s->h[i] == 0) continue;
+            j = umi_hash_insert(h, m, s->h[i]);
+            if (hs) hs[j] = s->hs[i];
+        }
+        free(s->h);
+        if (s->hs) free(s->hs);
+    }
+    s->h = h;
+    s->hs = hs;
+    s->m = m;
+}
+
+int umi_set_query_key(struct umi_set const *s, uint64_t key)
+{
+    uint32_t i;
+    if (s->m == 0) {
+        for (i = 0; i < s->n; ++i)
+            if (s->a[i] == key) return 1;
+        return 0;
+    }
+    if (key == 0) return s->zero;
+    for (i = umi_hash(key, s->m); s->h[i] != 0; i = (i + 1) & (s->m - 1))
+        if (s->h[i] == key) return 1;
+    return 0;
+}
+
+static inline void umi_set_state(struct umi_set *s, uint32_t i, int state)
+{
+    if (state == 0) return;
+    if (s->hs == NULL) s->hs = calloc(s->m, 1);
+    s->hs[i] |= state;
+}
+
+int umi_set_push_key(struct umi_set *s, uint64_t key, int state)
+{
+    uint32_t i;
+    if (s->m == 0) {
+        for (i = 0; i < s->n; ++i) {
+            if (s->a[i] == key) {
+                s->state[i] |= state;
+                return 0;
+            }
+        }
+        if (s->n < UMI_SET_INLINE) {
+            s->a[s->n] = key;
+            s->state[s->n] = state;
+            s->n++;
+            return 1;
+        }
+        umi_set_resize(s, 16);
+    }
+    
+    if (key == 0) {
+        s->zero_state |= state;
+        if (s->zero) return 0;
+        s->zero = 1;
+        s->n++;
+        return 1;
+    }
+
+    for (i = umi_hash(key, s->m); s->h[i] != 0; i = (i + 1) & (s->m - 1)) {
+        if (s->h[i] == key) {
+            umi_set_state(s, i, state);
+            return 0;
+        }
+    }
+    // keep load factor below 0.5
+    if ((s->n + 1) * 2 > s->m) {
+        umi_set_resize(s, s->m * 2);
+        i = umi_hash_insert(s->h, s->m, key);
+    }
+    else s->h[i] = key;
+    umi_set_state(s, i, state);
+    s->n++;
+    return 1;
+}
+
+int umi_set_push_state(struct umi_set *s, const char *seq, int state)
+{
+    int l = strlen(seq);
+    if (s->len == 0) s->len = l;
+    if (s->len != l) error("Try to insert an unequal length sequence. %s, %d vs %d.", seq, l, s->len);
+
+    uint64_t key;
+    if (umi_pack(seq, l, &key) == 0) return umi_set_push_key(s, key, state);
+
+    if (s->str == NULL) s->str = kh_init(umi);
+    kh_umi_t *h = (kh_umi_t*)s->str;
+    khint_t k = kh_get(umi, h, seq);
+    if (k != kh_end(h)) {
+        kh_val(h, k) |= state;
+        return 0;
+    }
+    int ret;
+    k = kh_put(umi, h, strdup(seq), &ret);
+    kh_val(h, k) = state;
+    return 1;
+}
+
+int umi_set_push(struct umi_set *s, const char *seq)
+{
+    return umi_set_push_state(s, seq, 0);
+}
+
+uint32_t umi_set_size(struct umi_set const *s)
+{
+    return s->n + (s->str ? kh_size((kh_umi_t*)s->str) : 0);
+}
+
+void umi_set_count_state(struct umi_set const *s, uint32_t *n)
+{
+    uint32_t i;
+    memset(n, 0, 4*sizeof(uint32_t));
+    if (s->m == 0) {
+        for (i = 0; i < s->n; ++i) n[s->state[i]&3]++;
+    }
+    else {
+        if (s->zero) n[s->zero_state&3]++;
+        for (i = 0; i < s->m; ++i)
+            if (s->h[i] != 0) n[s->hs ? s->hs[i]&3 : 0]++;
+    }
+    if (s->str) {
+        kh_umi_t *h = (kh_umi_t*)s->str;
+        khint_t k;
+        for (k = kh_begin(h); k != kh_end(h); ++k)
+            if (kh_exist(h, k)) n[kh_val(h, k)&3]++;
+    }
+}
@@ -0,0 +1,51 @@
+#ifndef UMI_SET_H
+#define UMI_SET_H
+#include "utils.h"
+
+// UMIs in one set are 2-bit packed into a 64-bit key. A few UMIs are kept inline, more
+// UMIs go to an open-addressing hash table. UMIs can not be packed (with N or longer than
+// 32 bp) are kept as strings.
+#define UMI_SET_INLINE 3
+
+// Each UMI has a state, bits pushed with this UMI are ORed. Used by velocity mode to tell
+// UMIs seen in spliced, unspliced or both kinds of reads.
+#define UMI_SPLICED   1
+#define UMI_UNSPLICED 2
+
+struct umi_set {
+    uint32_t n; // packed UMIs
+    uint32_t m; // hash slots, 0 for inline
+    int len;    // umi length, all UMIs in the set should be equal length
+    uint8_t zero;  // key 0 (poly-A) is in hash table, 0 is the empty slot
+    uint8_t zero_state;
+    uint8_t state[UMI_SET_INLINE]; // states of inline UMIs
+    union {
+        uint64_t a[UMI_SET_INLINE];
+        struct {
+            uint64_t *h;
+            uint8_t *hs; // states of hash slots, allocated once a state is set
+        };
+    };
+    void *str; // unpacked UMIs
+};
+
+// return 0 and packed key, or -1 if sequence can not be packed
+int umi_pack(const char *seq, int l, uint64_t *key);
+
+void umi_set_init(struct umi_set *s);
+void umi_set_clear(struct umi_set *s);
+
+// return 1 if UMI is new, 0 for already in the set
+int umi_set_push(struct umi_set *s, const char *seq);
+int umi_set_push_state(struct umi_set *s, const char *seq, int state);
+int umi_set_push_key(struct umi_set *s, uint64_t key, int state);
+
+int umi_set_query_key(struct umi_set const *s, uint64_t key);
+
+// number of distinct UMIs
+uint32_t umi_set_size(struct umi_set const *s);
+
+// number of UMIs for each state, n[4]
+void umi_set_count_state(struct umi_set const *s, uint32_t *n);
+
+#endif
@@ -158,7 +158,8 @@ int rmdup_usage()
     fprintf(stderr, "\x1b[36m\x1b[1m$\x1b[0m \x1b[1mPISA\x1b[0m rmdup -tags CB,UR -o rmdup.bam in.bam\n");
     fprintf(stderr, "\nOptions :\n");
     fprintf(stderr, "   -tags  [TAGS]       Barcode tags to group reads.\n");
-    fprintf(stderr, "   -@     [INT]        Threads to unpack BAM.\n");
+    fprintf(stderr, "   -@     [INT]        Threads to unpack and compress BAM.\n");
+    fprintf(stderr, "   -t     [INT]        Threads to deduplicate regions in parallel, require indexed BAM.\n");
     fprintf(stderr, "   -o     [BAM]        Output bam.\n");
     fprintf(stderr, "   -q     [INT]        Map Quality Score cutoff.\n");
     // fprintf(stderr, "   -S                  Treat PE reads as SE.\n");
@@ -192,6 +193,7 @@ int anno_usage()
     fprintf(stderr, "\nOptions :\n");
     fprintf(stderr, " -o        [BAM]       Output bam file.\n");
     fprintf(stderr, " -report   [csv]       Summary report.\n");
+    fprintf(stderr, " -group    [TAG]       Summary report for each group (e.g. sample tag) seperately. One row per group in the report.\n");
     fprintf(stderr, " -@        [INT]       Threads to compress bam file.\n");
     fprintf(stderr, " -q        [0]         Map Quality Score cutoff. MapQ smaller and equal to this value will not be annotated.\n");
     fprintf(stderr, " -t        [INT]       Threads to annotate.\n");
@@ -214,6 +216,7 @@ int anno_usage()
     fprintf(stderr, " -intron               Reads covered intron regions will also be annotated with all tags.\n");
     fprintf(stderr, " -tss                  Annotate reads start from TSS, designed for capped library. **experiment**\n");
     fprintf(stderr, " -ctag     [TAG]       Tag name for TSS annotation. Need set with -tss.\n");
+    fprintf(stderr, " -ftag     [TAG]       Also write gene name as integer ID into this tag, for `\x1b[1mPISA\x1b[0m count -ftag`.\n");
 
     fprintf(stderr, "\nOptions for VCF file :\n");
     fprintf(stderr, " -vcf      [VCF/BCF]   Varaints.\n");
@@ -226,6 +229,7 @@ int anno_usage()
     fprintf(stderr, "   GN : Gene name.\n");
     fprintf(stderr, "   GX : Gene ID.\n");
     fprintf(stderr, "   RE : Region type, E (Exon), N (Intron), C (Exon and Intron), S (junction reads cover isoforms properly), V (ambiguous reads), I (Intergenic), A (Anitisense)\n");
+    fprintf(stderr, " * -ftag writes an integer array in the same order as GN, names of IDs are kept in header as `@CO FI:TAG:ID NAME` lines.\n");
     fprintf(stderr, "\n");
     return 1;
 }
@@ -242,7 +246,11 @@ int bam_corr_usage()
     fprintf(stderr, " -tags-block  [TAGS]   Tags to define read group. For example, if set to GN (gene), reads in the same gene will be grouped together.\n");
     fprintf(stderr, " -cr                   Enable CellRanger like UMI correction method. See `Demo` for details.\n");
     fprintf(stderr, " -e                    Maximal hamming distance to define similar barcode, default is 1.\n");
+    fprintf(stderr, " -method   [STR]       UMI network method, cluster, adjacency or directional (UMI-tools like). [cluster]\n");
     fprintf(stderr, " -@        [INT]       Thread to compress BAM file.\n");
+    fprintf(stderr, " -cell-sorted          Records are grouped by cell barcode (first tag of -tags-block). Correct each cell once it is read, input is read only once.\n");
+    fprintf(stderr, " -m        [mem]       Memory cap of UMI index. Index is split into buckets by cell barcode on disk, and built by batches under this cap.\n");
+    fprintf(stderr, " -prefix   [STR]       Prefix of temp files for -m. [output bam]\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "Demo : \n");
     fprintf(stderr, " // Two groups of reads have same cell barcode (CB) and gene (GN) but their UMIs (UY) differ by only one base. The UMI of less supported\n");
@@ -252,6 +260,9 @@ int bam_corr_usage()
     fprintf(stderr, " // is kept for UMI counting, and the other read groups are discarded. In case of a tie for maximal read support, all read groups are\n");
     fprintf(stderr, " // discarded, as the gene cannot be confidently assigned (Cell Ranger method).\n");
     fprintf(stderr, "\x1b[36m\x1b[1m$\x1b[0m \x1b[1mPISA\x1b[0m corr -cr -tag UY -new-tag UB -tags-block CB,GN in.bam -o corr.bam \n\n");
+    fprintf(stderr, " // cluster    : all linked UMIs are corrected to the UMI with the highest support.\n");
+    fprintf(stderr, " // adjacency  : fewest UMIs of the highest support covering linked UMIs are kept, their neighbors are corrected to them.\n");
+    fprintf(stderr, " // directional: UMI a is linked to UMI b only if count(a) >= 2*count(b)-1, UMIs reachable from the top UMI are corrected to it.\n");
     fprintf(stderr, "\n");
     return 1;
 }
@@ -303,14 +314,18 @@ int bam_count_usage()
     fprintf(stderr, "\nOptions :\n");
     fprintf(stderr, " -cb       [TAG]      Cell barcode tag.\n");
     fprintf(stderr, " -anno-tag [TAG]      Annotation tag, gene or peak.\n");
+    fprintf(stderr, " -ftag     [TAG]      Integer feature ID tag written by `\x1b[1mPISA\x1b[0m anno -ftag`, used instead of -anno-tag. Faster.\n");
     fprintf(stderr, " -list     [file]     Barcode white list, used as column names at matrix. If not set, all barcodes will be count.\n");
     //fprintf(stderr, " -o        [file]     Output matrix.\n");
     fprintf(stderr, " -outdir   [DIR]      Output matrix in MEX format into this fold.\n");
     fprintf(stderr, " -umi      [TAG]      UMI tag. Count once if more than one record has same UMI in one gene or peak.\n");
     fprintf(stderr, " -one-hit             Skip if a read hits more than 1 gene or peak.\n");
+    fprintf(stderr, " -bin                 Also write matrix in binary CSC format (matrix.bin) into outdir.\n");
+    fprintf(stderr, " -cell-sorted         Records are grouped by cell barcode. Write counts of each cell once cell changed, memory stays flat.\n");
     // fprintf(stderr, " -corr                Enable correct UMIs. Similar UMIs defined as amming distance <= 1.\n");
     fprintf(stderr, " -q        [INT]      Minimal map quality to filter. Default is 20.\n");
-    fprintf(stderr, " -@        [INT]      Threads to unpack BAM.\n");
+    fprintf(stderr, " -@        [INT]      Threads to unpack BAM and count reads. [5]\n");
+    fprintf(stderr, " -chunk    [INT]      Records per chunk for counting threads. [100000]\n");
     fprintf(stderr, " -ttag     [TAG]      Region type tag. [RE]\n");
     fprintf(stderr, " -velo                Generate spliced and unspliced matrix files for RNA velocity analysis.\n");
     fprintf(stderr, " -ttype    [TYPE]     Region type used to count. Set `E,S` to count exon enclosed reads. Set `N,C` to count intron overlapped reads.\n");
@@ -322,8 +337,15 @@ int bam_count_usage()
     fprintf(stderr, "   to one of region types(E/S/C/N) or combination to count reads mapped to these functional regions only.\n");
     fprintf(stderr, " * If you want count from more than one bam file, there are two ways to set the parameter. By seperating bam files with ',' or by\n");
     fprintf(stderr, "   setting -sample-list option. But if you want alias each bam with a predefined cell name, only -sample-list supported.\n");
+    fprintf(stderr, "   With -@ more than 1, these bam files are read at the same time, except -cell-sorted.\n");
     fprintf(stderr, " * -cb conflict with -file-barcode. \x1b[1mPISA\x1b[0m read cell barcode from bam tag or alias name list. Not both.\n");
-    fprintf(stderr, " * If -velo set, spliced and unspliced folders will be created at outdir.\n");
+    fprintf(stderr, " * If -velo set, spliced, unspliced and ambiguous matrices will be created at outdir. UMIs found in both spliced and\n");
+    fprintf(stderr, "   unspliced reads are ambiguous, they are also counted in unspliced matrix. Ambiguous matrix needs -umi.\n");
+    fprintf(stderr, " * Binary matrix (-bin) is little-endian, \"PISAMTX\\1\", uint32 version, uint32 layout (0, CSC), uint64 features, cells, nnz,\n");
+    fprintf(stderr, "   uint64 indptr[cells+1], uint32 feature index (0-based) [nnz], uint32 counts [nnz]. One column per cell.\n");
+    fprintf(stderr, "   With -o, -bin writes dense matrix in BGZF, \"PISADNS\\1\", uint32 version, uint32 layout (0, one row per feature), uint64 features,\n");
+    fprintf(stderr, "   cells, cell names and feature names end with '\\0', uint32 counts [features][cells].\n");
+    fprintf(stderr, " * -cell-sorted works with -outdir only. Sort bam by cell barcode first, or use it with -file-barcode, one cell per bam.\n");
     fprintf(stderr,"\n");
     return 1;
 }